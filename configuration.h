@@ -20,6 +20,46 @@
 #include "usbconfig.h"
 #include "vmeconfig.h"
 
+#ifndef VME_CFG_INFO
+#define VME_CFG_INFO 1
+#endif
+#ifndef VME_CFG_PAGE_CRC
+#define VME_CFG_PAGE_CRC 0
+#endif
+#ifndef VME_CFG_PAGE_COPY
+#define VME_CFG_PAGE_COPY 0
+#endif
+#ifndef VME_CFG_DECOMPRESS
+#define VME_CFG_DECOMPRESS 0
+#endif
+#ifndef VME_CFG_VERIFY
+#define VME_CFG_VERIFY 0
+#endif
+#ifndef VME_CFG_STATS
+#define VME_CFG_STATS 0
+#endif
+#ifndef VME_CFG_EXPORTS
+#define VME_CFG_EXPORTS 0
+#endif
+#ifndef VME_CFG_DIRECT_ABI
+#define VME_CFG_DIRECT_ABI 0
+#endif
+#ifndef VME_CFG_OSCCAL_TRACK
+#define VME_CFG_OSCCAL_TRACK 0
+#endif
+#ifndef VME_OSCCAL_TRACK_FRAMES
+#define VME_OSCCAL_TRACK_FRAMES 16
+#endif
+#ifndef VME_CFG_STAGING
+#define VME_CFG_STAGING 0
+#endif
+#ifndef VME_SPM_WRITE_US
+#define VME_SPM_WRITE_US 4500
+#endif
+#ifndef VME_SPM_ERASE_US
+#define VME_SPM_ERASE_US 4500
+#endif
+
 #ifndef USB_CFG_LONG_TRANSEFRS
 #define USB_CFG_LONG_TRANSEFRS 0
 #endif
@@ -149,4 +189,92 @@
 	(USB_HAS_CFG_RX_USER_HOOK << 12) | \
 	(USB_HAS_CFG_RESET_HOOK << 13) | \
 	(USB_HAS_CFG_SET_ADDRESS_HOOK << 14)
+
+/*
+ * Bits of configuration word 0 that only describe the bootloader image and
+ * are not part of the configuration the user program must match
+ *    Bit 14 - usbSetInterrupt/usbGenericSetInterrupt vector present
+ *    Bit 15 - Info block present before the vectors
+ */
+#define VME_CFG_WORD_0_SETINT	(1 << 14)
+#define VME_CFG_WORD_0_INFO	(1 << 15)
+
+/*
+ * Set in the copy of configuration word 0 in the user signature row of a
+ * user program linked directly against the bootloader (VME_CFG_DIRECT_ABI).
+ * The ABI hash of the bootloader it was linked against follows word 1.
+ */
+#define VME_CFG_WORD_0_DIRECT_ABI	(1 << 13)
+
+/*
+ * Set in the copy of configuration word 0 in the user signature row when
+ * the EEPROM writer there takes fill records. The low byte holds the page
+ * count only in the bootloader copy.
+ */
+#define VME_CFG_WORD_0_EEPROM_FILL	(1 << 7)
+
+/* First word of the staging header page, see vme_stage_commit() */
+#define VME_STAGE_MAGIC		0x5356
+
+#if !USB_CFG_SUPPRESS_INTR_CODE && \
+	(USB_CFG_HAVE_INTRIN_ENDPOINT || USB_CFG_HAVE_INTRIN_ENDPOINT3)
+#define VME_CFG_WORD_0_FLAGS_SETINT VME_CFG_WORD_0_SETINT
+#else
+#define VME_CFG_WORD_0_FLAGS_SETINT 0
+#endif
+
+#if VME_CFG_INFO
+#define VME_CFG_WORD_0_FLAGS (VME_CFG_WORD_0_FLAGS_SETINT | VME_CFG_WORD_0_INFO)
+#else
+#define VME_CFG_WORD_0_FLAGS VME_CFG_WORD_0_FLAGS_SETINT
+#endif
+
+/*
+ * Info block
+ *   Word 0: Feature bits, optional paths the programming tool may use
+ *    Bit 0 - VME_CFG_CRC, commands are checked before they are run
+ *    Bit 1 - Reads of up to 254 bytes are returned in a single transfer
+ *    Bit 2 - VME_CFG_PAGE_CRC, page writes carry a CRC of the filled words
+ *    Bit 3 - VME_CFG_PAGE_COPY, page buffer can be filled from flash
+ *    Bit 4 - VME_CFG_DECOMPRESS, pages can be sent as a compressed stream
+ *    Bit 5 - VME_CFG_VERIFY, written pages can be checked against a CRC
+ *    Bit 6 - VME_CFG_STATS, the bootloader keeps statistics counters
+ *   Word 1: Erase page size in bytes
+ *   Word 2: EEPROM size in bytes
+ *   Byte 6: Write pages per erase page
+ *   Byte 7: Page write time in units of 100us
+ *   Byte 8: Page erase time in units of 100us
+ *   Byte 9: Reserved
+ *   Word 5: RAM address of the page write status (VME_CFG_PAGE_CRC)
+ *   Word 6: RAM address of the verify status (VME_CFG_VERIFY)
+ *   Word 7: RAM address of the statistics block (VME_CFG_STATS)
+ *   Word 8: ABI hash of the directly exported entry points and shared RAM
+ *           (VME_CFG_DIRECT_ABI), zero if user programs must use the vectors
+ *   Byte 18: Info block version
+ *   Byte 19: Info block size in bytes
+ */
+#define VME_INFO_VERSION 1
+
+#define VME_FEATURE_CRC		(1 << 0)
+#define VME_FEATURE_LONG_READ	(1 << 1)
+#define VME_FEATURE_PAGE_CRC	(1 << 2)
+#define VME_FEATURE_PAGE_COPY	(1 << 3)
+#define VME_FEATURE_DECOMPRESS	(1 << 4)
+#define VME_FEATURE_VERIFY	(1 << 5)
+#define VME_FEATURE_STATS	(1 << 6)
+
+#define VME_INFO_FEATURES ( \
+	(VME_CFG_CRC * VME_FEATURE_CRC) | \
+	VME_FEATURE_LONG_READ | \
+	(VME_CFG_PAGE_CRC * VME_FEATURE_PAGE_CRC) | \
+	(VME_CFG_PAGE_COPY * VME_FEATURE_PAGE_COPY) | \
+	(VME_CFG_DECOMPRESS * VME_FEATURE_DECOMPRESS) | \
+	(VME_CFG_VERIFY * VME_FEATURE_VERIFY) | \
+	(VME_CFG_STATS * VME_FEATURE_STATS))
+
+#ifdef E2END
+#define VME_EEPROM_SIZE (E2END + 1)
+#else
+#define VME_EEPROM_SIZE 0
+#endif
 #endif
@@ -32,6 +32,7 @@
 #define usbSetInterrupt real_usbSetInterrupt
 
 #include "osc_ver.h"
+#include "pagesize.h"
 #include "usbconfig.h"
 #include "vmeconfig.h"
 
@@ -45,9 +46,62 @@
 
 /* command system schedules functions to run in the main loop */
 enum {
+	cmd_buf_fill = 1,
+	cmd_page_erase = 3,
+	cmd_page_write = 5,
+	cmd_stream_data = 0x40,
+	cmd_stream_begin = 0x41,
+	cmd_page_verify = 0x42,
+	cmd_verify_clear = 0x43,
 	cmd_exit = 128,
 };
 
+/* State only used in bootloader mode is kept in .noinit, after the V-USB
+ * state shared with the user program, so the user program can reuse it */
+#if VME_CFG_PAGE_CRC
+/* Result of the last page write CRC check, zero if it matched */
+uint8_t vme_page_status __attribute__((used,section(".noinit")));
+#endif
+
+#if VME_CFG_VERIFY
+/* Number of pages that failed cmd_page_verify (saturating) and the address of
+ * the first one. Not cleared at reset, the host sends cmd_verify_clear. */
+struct {
+	uint8_t errors;
+	uint16_t page;
+} vme_verify_status __attribute__((used,section(".noinit")));
+#endif
+
+#ifdef RAMPZ
+/* V-USB reads flash with lpm, flash reads past 64KB are copied here with elpm
+ * and returned as a RAM read. The host reads at most 8 bytes at a time there. */
+#define VME_ELPM_BUF_LEN 8
+uint8_t vme_elpm_buf[VME_ELPM_BUF_LEN] __attribute__((used,section(".noinit")));
+#endif
+
+#if VME_CFG_STATS
+/* Counters for the host to read back, they survive the bootloader restarting
+ * itself. Cleared when the magic byte does not match, after power up or once
+ * the user program has reused the RAM. */
+#define VME_STATS_MAGIC 0x5a
+struct {
+	uint8_t magic;
+	uint16_t resets;	/* Bootloader mode entries */
+	uint16_t crc_errors;	/* VME_CFG_CRC failures */
+	uint16_t descriptors;	/* Descriptor requests */
+	uint16_t setups;	/* Setup packets */
+	uint16_t spm[4];	/* Buffer fill, page erase, page write, other */
+	uint16_t frames;	/* SOF count (USB_COUNT_SOF) */
+} vme_stats __attribute__((used,section(".noinit")));
+#endif
+
+/* User program callbacks may be out of rcall range on larger parts */
+#if defined(__AVR_HAVE_JMP_CALL__)
+#define USER_CALL "call"
+#else
+#define USER_CALL "rcall"
+#endif
+
 #define isUserMode() !(USB_GPIOR(VME_MODE_GPIOR_IDX) & _BV(VME_MODE_GPIOR_BIT))
 
 /* Wrap the hooks if so enabled */
@@ -113,11 +167,19 @@ USB_PUBLIC uchar usbFunctionWrite(uchar *data, uchar len)
 #if !USB_CFG_SUPPRESS_INTR_CODE
 #if USB_CFG_HAVE_INTRIN_ENDPOINT
 #if USB_CFG_HAVE_INTRIN_ENDPOINT3
+#if VME_CFG_DIRECT_ABI
+void usbGenericSetInterrupt(uchar *data, uchar len, usbTxStatus_t *txStatus)
+	__attribute__((alias("real_usbGenericSetInterrupt")));
+#else
 void usbGenericSetInterrupt(uchar *data, uchar len, usbTxStatus_t *txStatus)
 {
 	real_usbGenericSetInterrupt(data, len, txStatus);
 }
+#endif
 USB_PUBLIC void usbSetInterrupt(uchar *data, uchar len) __attribute__((unused));
+#elif VME_CFG_DIRECT_ABI
+void usbSetInterrupt(uchar *data, uchar len)
+	__attribute__((alias("real_usbSetInterrupt")));
 #else
 void usbSetInterrupt(uchar *data, uchar len)
 {
@@ -136,7 +198,12 @@ USB_PUBLIC usbMsgLen_t usbFunctionDescriptor(usbRequest_t *rq)
 }
 
 /* usbPoll and usbInit are declared static, so we wrap them here to get symbols
- * for exporting */
+ * for exporting. With VME_CFG_DIRECT_ABI the user program calls these symbols
+ * directly, aliasing guarantees there is no extra call in between. */
+#if VME_CFG_DIRECT_ABI
+void usbInit(void) __attribute__((alias("real_usbInit")));
+void usbPoll(void) __attribute__((alias("real_usbPoll")));
+#else
 void usbInit(void)
 {
 	real_usbInit();
@@ -146,6 +213,126 @@ void usbPoll(void)
 {
 	real_usbPoll();
 }
+#endif
+
+#if VME_CFG_OSCCAL_TRACK
+#if !USB_COUNT_SOF
+#error VME_CFG_OSCCAL_TRACK requires USB_COUNT_SOF
+#endif
+#ifndef TCCR0B
+#error VME_CFG_OSCCAL_TRACK requires Timer0 with TCCR0B
+#endif
+
+/* Timer0 ticks (clk/64) expected over VME_OSCCAL_TRACK_FRAMES frames */
+#define VME_OSCCAL_TRACK_TICKS \
+	(VME_OSCCAL_TRACK_FRAMES * (F_CPU / 64) / 1000)
+/* About half of an OSCCAL step */
+#define VME_OSCCAL_TRACK_SLACK (VME_OSCCAL_TRACK_TICKS / 400)
+/* Two frames over the measurement, frames have stopped (suspend, reset) */
+#define VME_OSCCAL_TRACK_TIMEOUT \
+	(VME_OSCCAL_TRACK_TICKS + 2 * (F_CPU / 64) / 1000)
+
+/* Never step out of the current range */
+#if OSC_VER == 4 || OSC_VER == 5
+#define VME_OSCCAL_TRACK_MAX 0x7f
+#else
+#define VME_OSCCAL_TRACK_MAX 0xff
+#endif
+
+/*
+ * Exported to the user program for following oscillator drift. Times
+ * VME_OSCCAL_TRACK_FRAMES frames against Timer0 and moves OSCCAL one step
+ * toward F_CPU if it is off by more than VME_OSCCAL_TRACK_SLACK. Blocks for
+ * one frame more than that, returns 0 without a step if frames stop for
+ * longer than that. Timer0 keeps counting but runs at clk/64 during the
+ * call. Returns the step taken, -1, 0 or 1.
+ */
+schar vmeOsccalTrack(void)
+{
+	uint8_t tccr = TCCR0B;
+	uint8_t sof;
+	uint8_t last;
+	uint8_t now;
+	uint16_t ticks = 0;
+	schar step = 0;
+
+	TCCR0B = _BV(CS01) | _BV(CS00);
+
+	/* Start on a frame boundary. Timer0 is polled well within its 256
+	 * tick wrap, ticks counts its overflows too. */
+	sof = usbSofCount;
+	last = TCNT0;
+	do {
+		now = TCNT0;
+		ticks += (uint8_t) (now - last);
+		last = now;
+		if (ticks > VME_OSCCAL_TRACK_TIMEOUT)
+			goto out;
+	} while (usbSofCount == sof);
+	sof = usbSofCount;
+	ticks = 0;
+
+	do {
+		now = TCNT0;
+		ticks += (uint8_t) (now - last);
+		last = now;
+		if (ticks > VME_OSCCAL_TRACK_TIMEOUT)
+			goto out;
+	} while ((uint8_t) (usbSofCount - sof) < VME_OSCCAL_TRACK_FRAMES);
+
+	if (ticks > VME_OSCCAL_TRACK_TICKS + VME_OSCCAL_TRACK_SLACK) {
+		if (OSCCAL_REG & VME_OSCCAL_TRACK_MAX)
+			step = -1;
+	} else if (ticks < VME_OSCCAL_TRACK_TICKS - VME_OSCCAL_TRACK_SLACK) {
+		if ((OSCCAL_REG & VME_OSCCAL_TRACK_MAX) != VME_OSCCAL_TRACK_MAX)
+			step = 1;
+	}
+	OSCCAL_REG += step;
+out:
+	TCCR0B = tccr;
+	return step;
+}
+#endif
+
+#if VME_CFG_STAGING
+/* Jump to the user program from vectors.S, in the last user page */
+extern char user_reset[];
+
+#define VME_STAGE_LAST	((uint16_t) user_reset & ~(PAGESIZE - 1))
+#define VME_STAGE_HEADER (VME_STAGE_LAST - PAGESIZE)
+
+#include "stage.c"
+
+/*
+ * Exported to the user program for staging an image while it runs. Runs
+ * one SPM command, __BOOT_PAGE_FILL, __BOOT_PAGE_ERASE or __BOOT_PAGE_WRITE,
+ * and waits for it to finish. Anything at or past the last user page is
+ * ignored so the jumps to the user program and the bootloader stay intact.
+ */
+void vmeStageSpm(uint16_t addr, uint16_t data, uchar cmd)
+{
+	uint8_t sreg;
+
+	if (addr >= VME_STAGE_LAST)
+		return;
+	sreg = SREG;
+	cli();
+	asm volatile(
+"	movw	r0, %[data]\n"
+"	out	%[spm], %[cmd]\n"
+"	spm\n"
+"	clr	__zero_reg__\n"
+	:
+	:	[addr] "z" (addr),
+		[data] "r" (data),
+		[cmd] "r" (cmd),
+		[spm] "I" (_SFR_IO_ADDR(__SPM_REG))
+	:	"r0");
+	if (cmd != __BOOT_PAGE_FILL)
+		stage_spm_wait();
+	SREG = sreg;
+}
+#endif
 
 /* Just to save a couple of bytes */
 __attribute__((used,naked)) static void store_usbMsgPtr(void)
@@ -157,6 +344,22 @@ __attribute__((used,naked)) static void store_usbMsgPtr(void)
 	);
 }
 
+#if VME_CFG_STATS
+/* Increment the 16 bit counter at Z */
+__attribute__((used,naked)) static void vme_stats_inc(void)
+{
+	asm(
+"	ld	r22, Z\n"
+"	ldd	r23, Z + 1\n"
+"	subi	r22, 0xff\n"
+"	sbci	r23, 0xff\n"
+"	st	Z, r22\n"
+"	std	Z + 1, r23\n"
+"	ret\n"
+	);
+}
+#endif
+
 /* usbDriverDescriptor() is similar to usbFunctionDescriptor(), but used
  * internally for all types of descriptors.
  *
@@ -167,6 +370,12 @@ USB_PUBLIC usbMsgLen_t usbCustomDriverDescriptor(usbRequest_t *rq)
 	register uchar ret asm("r24");
 	asm (
 "usbCustomDriverDescriptorStart:\n"
+#if VME_CFG_STATS
+"	ldi	r30, lo8(%[stats_descriptors])\n"
+"	ldi	r31, hi8(%[stats_descriptors])\n"
+"	sbic	%[gpior_bl_reg], %[gpior_bl_bit]\n"
+"	rcall	vme_stats_inc\n"
+#endif
 "	ldd	r20, Y+2\n" /* idx */
 "	ldd	r19, Y+3\n" /* type */
 "	ldi	r18, %[is_rom]\n"
@@ -243,7 +452,7 @@ USB_PUBLIC usbMsgLen_t usbCustomDriverDescriptor(usbRequest_t *rq)
 "	sbic	%[gpior_bl_reg], %[gpior_bl_bit]\n"
 "	rjmp	usbCustomDriverDescriptorEnd\n"
 "	movw	r24, r28\n"
-"	rcall	user_usbDriverDescriptor\n"
+"	" USER_CALL "	user_usbDriverDescriptor\n"
 "usbCustomDriverDescriptorEnd:\n"
 	:	[ret] "=r"(ret)
 	:	[usbMsgFlags] "g"(usbMsgFlags),
@@ -251,6 +460,9 @@ USB_PUBLIC usbMsgLen_t usbCustomDriverDescriptor(usbRequest_t *rq)
 		[gpior_bl_bit] "M" (VME_MODE_GPIOR_BIT),
 		[usbdescr_config] "M" (USBDESCR_CONFIG),
 		[is_rom] "I" (USB_FLG_MSGPTR_IS_ROM),
+#if VME_CFG_STATS
+		[stats_descriptors] "i" (&vme_stats.descriptors),
+#endif
 		[rq] "y" (rq)
 	:	"r18", "r19", "r20", "r21", "r22", "r23", "r25", "r26", "r27", "r30", "r31"
 	
@@ -270,9 +482,14 @@ USB_PUBLIC uint8_t usbFunctionSetup(uint8_t data[8])
 
 	/* In user mode, just call the user_usbFunctionSetup */
 	"	sbis	%[gpior_bl_reg], %[gpior_bl_bit]\n"
-	"	rcall	user_usbFunctionSetup\n"
+	"	" USER_CALL "	user_usbFunctionSetup\n"
 	"	sbis	%[gpior_bl_reg], %[gpior_bl_bit]\n"
 	"	rjmp	usbFunctionSetupEnd\n"
+#if VME_CFG_STATS
+	"	ldi	r30, lo8(%[stats_setups])\n"
+	"	ldi	r31, hi8(%[stats_setups])\n"
+	"	rcall	vme_stats_inc\n"
+#endif
 
 	/* Clear T on Host-to-device, set T on Device-to-host */
 	"	bst	%[bmRequestType], 7\n"
@@ -283,9 +500,49 @@ USB_PUBLIC uint8_t usbFunctionSetup(uint8_t data[8])
 	"	subi	r24, 0xfe\n"
 	"	sbci	r25, 0x4f\n"
 	"	breq	1f\n"
+#if VME_CFG_STATS
+	"	ldi	r30, lo8(%[stats_crc_errors])\n"
+	"	ldi	r31, hi8(%[stats_crc_errors])\n"
+	"	rcall	vme_stats_inc\n"
+#endif
 	"	rjmp	__init\n" /* re-enumerate on CRC error */
 #endif
 	/* Load the values we'd use for a read */
+#ifdef RAMPZ
+	"1:	ldd	r25, Y + 2\n" /* wValue, bits 23:16 of the address */
+	"	out	%[rampz], r25\n"
+	"	ldd	r30, Y + 4\n" /* wIndex */
+	"	ldd	r31, Y + 5\n"
+	"	movw	r26, r30\n"
+	"	ldd	r22, Y + 1\n" /* bRequest */
+	/* Flash reads past the first bank go through vme_elpm_buf */
+	"	sbrs	%[bmRequestType], 7\n"
+	"	rjmp	2f\n"
+	"	cpi	r22, %[is_rom]\n"
+	"	brne	2f\n"
+	"	tst	r25\n"
+	"	breq	2f\n"
+	"	ldi	r26, lo8(vme_elpm_buf)\n"
+	"	ldi	r27, hi8(vme_elpm_buf)\n"
+	"	clr	r22\n" /* RAM read */
+#if defined(__AVR_HAVE_ELPMX__)
+	"3:	elpm	r25, z+\n"
+#else
+	"3:	elpm\n"
+	"	mov	r25, r0\n"
+	"	adiw	r30, 1\n"
+#endif
+	"	st	x+, r25\n"
+	"	cpi	r26, lo8(vme_elpm_buf + %[elpm_len])\n"
+	"	brne	3b\n"
+	"	sbiw	r26, %[elpm_len]\n"
+	"2:	rcall	store_usbMsgPtr\n"
+#ifdef USB_MSGFLAGS_REG
+	"	mov	%[usbMsgFlags], r22\n"
+#else
+	"	sts	usbMsgFlags, r22\n"
+#endif
+#else
 	"1:	ldd	r26, Y + 4\n" /* wIndex */
 	"	ldd	r27, Y + 5\n"
 	"	rcall	store_usbMsgPtr\n"
@@ -294,6 +551,7 @@ USB_PUBLIC uint8_t usbFunctionSetup(uint8_t data[8])
 #else
 	"	ldd	r22, Y + 1\n" /* bRequest */
 	"	sts	usbMsgFlags, r22\n"
+#endif
 #endif
 	/* Read only occurs if ret is non-zero */
 	"	ldd	%[ret], Y + 6\n" /* wLength */
@@ -302,6 +560,14 @@ USB_PUBLIC uint8_t usbFunctionSetup(uint8_t data[8])
 	:	[gpior_bl_reg] "I" (_SFR_IO_ADDR(USB_GPIOR(VME_MODE_GPIOR_IDX))),
 		[gpior_bl_bit] "M" (VME_MODE_GPIOR_BIT),
 		[is_rom] "M"(USB_FLG_MSGPTR_IS_ROM),
+#if VME_CFG_STATS
+		[stats_setups] "i" (&vme_stats.setups),
+		[stats_crc_errors] "i" (&vme_stats.crc_errors),
+#endif
+#ifdef RAMPZ
+		[rampz] "I" (_SFR_IO_ADDR(RAMPZ)),
+		[elpm_len] "M" (VME_ELPM_BUF_LEN),
+#endif
 #ifdef USB_MSGFLAGS_REG
 		[usbMsgFlags] "r"(usbMsgFlags),
 #endif
@@ -323,9 +589,17 @@ void __init(void)
 "1:	in	r24, %[mcusr]\n"	/* Save reset reason */
 "	clr	__zero_reg__\n"
 "	out	%[mcusr], __zero_reg__\n" /* Clear reset reason register */
+#if VME_CFG_STAGING
+"	mov	r17, r24\n"
+"	rcall	vme_stage_commit\n"
+"	mov	r24, r17\n"
+#endif
 
 /* Setup r1 and SP */
 "bl_exit:\n"
+#ifdef RAMPZ
+"	out	%[rampz], __zero_reg__\n"
+#endif
 
 /* Clear BSS (Requires BSS with size >0 <255) */
 "	ldi	r30, lo8(__bss_start)\n"
@@ -350,7 +624,7 @@ void __init(void)
 /* Jump to user program if it's a power on, brown out reset or cmd_exit. Note
  * that the reason will be stored in r24 for the user program */
 "	andi	r24, %[rst_mask]\n"
-"	brne	__init - 4\n"
+"	brne	__init - %[user_end]\n"
 
 /* Set bootloader and irqless mode flags */
 "	sbi	%[gpior_bl_reg], %[gpior_bl_bit]\n"
@@ -359,6 +633,29 @@ void __init(void)
 "	sbi	%[gpior_irqless_reg], %[gpior_irqless_bit]\n"
 #endif
 
+#if VME_CFG_STATS
+/* Start the counters over if they have not been set up */
+"	ldi	r30, lo8(vme_stats)\n"
+"	ldi	r31, hi8(vme_stats)\n"
+"	ldi	r24, %[stats_magic]\n"
+"	ld	r25, Z+\n"
+"	cp	r25, r24\n"
+"	breq	26f\n"
+"	movw	r26, r30\n"
+"	st	-X, r24\n"
+"	adiw	r26, 1\n"
+"	ldi	r25, %[stats_counters]\n"
+"27:	st	X+, __zero_reg__\n"
+"	dec	r25\n"
+"	brne	27b\n"
+"26:	rcall	vme_stats_inc\n" /* resets */
+#endif
+
+#if VME_CFG_PAGE_CRC
+"	clr	r2\n"	/* Page buffer CRC */
+"	clr	r3\n"
+#endif
+
 /* Initialize V-USB */
 "	rcall	usbInit\n"
 
@@ -366,6 +663,18 @@ void __init(void)
 "bl_main_loop:\n"
 "	set\n"			/* Set T flag (no write message) */
 "	rcall	usbPoll\n"
+#if VME_CFG_STATS && USB_COUNT_SOF
+/* Extend the 8 bit usbSofCount */
+"	lds	r24, usbSofCount\n"
+"	lds	r25, %[stats_frames]\n"
+"	sts	%[stats_frames], r24\n"
+"	cp	r24, r25\n"
+"	brsh	25f\n"
+"	lds	r24, %[stats_frames] + 1\n"
+"	inc	r24\n"
+"	sts	%[stats_frames] + 1, r24\n"
+"25:\n"
+#endif
 "	wdr\n"
 "	brts	bl_main_loop\n" /* T flag is cleared, we have a write command */
 
@@ -376,6 +685,20 @@ void __init(void)
 "	sub	r26, r24\n"
 "	sbci	r27, 0\n"  /* almost certainly not needed */
 "	ld	r24, X+\n" /* bRequest */
+#if VME_CFG_STATS
+"	ldi	r30, lo8(%[stats_spm])\n"
+"	ldi	r31, hi8(%[stats_spm])\n"
+"	cpi	r24, %[cmd_buf_fill]\n"
+"	breq	24f\n"
+"	adiw	r30, 2\n"
+"	cpi	r24, %[cmd_page_erase]\n"
+"	breq	24f\n"
+"	adiw	r30, 2\n"
+"	cpi	r24, %[cmd_page_write]\n"
+"	breq	24f\n"
+"	adiw	r30, 2\n"
+"24:	rcall	vme_stats_inc\n"
+#endif
 "	cpi	r24, %[cmd_exit]\n" /* check if it's exit */
 "	breq	bl_exit\n"
 
@@ -384,6 +707,147 @@ void __init(void)
 "	ld	r1, X+\n"
 "	ld	r30, X+\n" /* wIndex */
 "	ld	r31, X+\n"
+#if VME_CFG_PAGE_COPY
+/* bRequest 0x81-0xff fills (bRequest & 0x7f) words of the page buffer
+ * starting at wIndex with words read from flash starting at wValue. Flags
+ * are still set from the cmd_exit compare. */
+"	brlo	7f\n"
+"	andi	r24, 0x7f\n"
+"	movw	r26, r0\n" /* Source */
+"8:	movw	r22, r30\n"
+"	movw	r30, r26\n"
+#if defined(__AVR_HAVE_LPMX__)
+"	lpm	r0, z+\n"
+"	lpm	r1, z+\n"
+#else
+"	lpm\n"
+"	mov	r25, r0\n"
+"	adiw	r30, 1\n"
+"	lpm\n"
+"	adiw	r30, 1\n"
+"	mov	r1, r0\n"
+"	mov	r0, r25\n"
+#endif
+"	movw	r26, r30\n"
+"	movw	r30, r22\n"
+"	ldi	r25, %[cmd_buf_fill]\n"
+"	out	%[spm], r25\n"
+"	spm\n"
+"	adiw	r30, 2\n"
+"	dec	r24\n"
+"	brne	8b\n"
+"	rjmp	1f\n"
+"7:\n"
+#endif
+#if VME_CFG_DECOMPRESS
+/* Compressed stream, cmd_stream_begin sets the output address in r4:r5 and
+ * each cmd_stream_data passes the 4 bytes in wValue/wIndex to the decoder.
+ * r16 holds the decoder state and r17 the pending byte. */
+"	cpi	r24, %[cmd_stream_begin]\n"
+"	brne	9f\n"
+"	movw	r4, r30\n"
+"	clr	r16\n"
+"	rjmp	1f\n"
+"9:	cpi	r24, %[cmd_stream_data]\n"
+"	brne	10f\n"
+"	sbiw	r26, 4\n"
+"	ldi	r18, 4\n"
+"11:	ld	r24, X+\n"
+"	rcall	stream_byte\n"
+"	dec	r18\n"
+"	brne	11b\n"
+"	rjmp	1f\n"
+"10:\n"
+#endif
+#if VME_CFG_VERIFY
+/* Compare the CRC16 of the flash page at wIndex against wValue. Mismatches
+ * are counted in vme_verify_status, the first one also latches the page. */
+"	cpi	r24, %[cmd_verify_clear]\n"
+"	brne	15f\n"
+"	clr	r24\n"
+"	rjmp	17f\n"
+"15:	cpi	r24, %[cmd_page_verify]\n"
+"	brne	18f\n"
+"16:	in	r25, %[spm]\n" /* Wait for the page write to finish */
+"	sbrc	r25, 0\n"
+"	rjmp	16b\n"
+#ifdef RWWSRE
+"	ldi	r25, %[rww_enable]\n"
+"	out	%[spm], r25\n"
+"	spm\n"
+#endif
+"	movw	r22, r0\n"
+"	movw	r26, r30\n"
+"	clr	r18\n"
+"	clr	r19\n"
+"	ldi	r20, %[page_size]\n"
+#if defined(__AVR_HAVE_LPMX__)
+"19:	lpm	r24, z+\n"
+#else
+"19:	lpm\n"
+"	mov	r24, r0\n"
+"	adiw	r30, 1\n"
+#endif
+"	eor	r18, r24\n"
+"	ldi	r24, 0x01\n"
+"	ldi	r25, 0xa0\n"
+"	ldi	r21, 8\n"
+"20:	lsr	r19\n"
+"	ror	r18\n"
+"	brcc	21f\n"
+"	eor	r18, r24\n"
+"	eor	r19, r25\n"
+"21:	dec	r21\n"
+"	brne	20b\n"
+"	dec	r20\n"
+"	brne	19b\n"
+"	cp	r18, r22\n"
+"	cpc	r19, r23\n"
+"	brne	22f\n"
+"	rjmp	1f\n"
+"22:	lds	r24, vme_verify_status\n"
+"	tst	r24\n"
+"	brne	23f\n"
+"	sts	vme_verify_status + 1, r26\n"
+"	sts	vme_verify_status + 2, r27\n"
+"23:	inc	r24\n"
+"	brne	17f\n"
+"	dec	r24\n" /* Saturate */
+"17:	sts	vme_verify_status, r24\n"
+"	rjmp	1f\n"
+"18:\n"
+#endif
+#if VME_CFG_PAGE_CRC
+/* Keep a CRC16 of the words filled into the page buffer in r2:r3. The page
+ * write command carries the expected CRC in wValue and is dropped if it does
+ * not match, the host reads back vme_page_status and retries. */
+"	cpi	r24, %[cmd_buf_fill]\n"
+"	brne	3f\n"
+"	ldi	r22, 0x01\n"
+"	ldi	r23, 0xa0\n"
+"	eor	r2, r0\n"
+"	ldi	r25, 16\n"
+"2:	cpi	r25, 8\n"
+"	brne	4f\n"
+"	eor	r2, r1\n" /* Second byte after the first 8 bits */
+"4:	lsr	r3\n"
+"	ror	r2\n"
+"	brcc	5f\n"
+"	eor	r2, r22\n"
+"	eor	r3, r23\n"
+"5:	dec	r25\n"
+"	brne	2b\n"
+"3:	cpi	r24, %[cmd_page_write]\n"
+"	brne	6f\n"
+"	eor	r0, r2\n"
+"	eor	r1, r3\n"
+"	clr	r2\n"
+"	clr	r3\n"
+"	or	r0, r1\n"
+"	sts	vme_page_status, r0\n"
+"	brne	1f\n" /* Mismatch, skip the write */
+"6:\n"
+#endif
 "	out	%[spm], r24\n"
 "	spm\n"
 #if defined(__AVR_ATmega161__) || defined(__AVR_ATmega163__) \
@@ -393,11 +857,118 @@ void __init(void)
 #endif
 "1:	clr	__zero_reg__\n"
 "	rjmp	bl_main_loop\n"
+
+#if VME_CFG_DECOMPRESS
+/*
+ * Decode one stream byte from r24. Tokens:
+ *   00LLLLLL - L + 1 literal words follow, low byte first
+ *   01xxxxxx - No-op, used as padding
+ *   1LLLDDDD DDDDDDDD - Copy L + 2 words from D + 1 words back in flash
+ * r16 is the number of literal bytes still to come, or 0xff if the second
+ * byte of a copy is pending. Filling the last word of a page writes it.
+ */
+"stream_byte:\n"
+"	cpi	r16, 0xff\n"
+"	breq	stream_copy\n"
+"	tst	r16\n"
+"	breq	stream_token\n"
+"	dec	r16\n"
+"	sbrc	r16, 0\n"
+"	rjmp	stream_pending\n" /* Low byte */
+"	mov	r0, r17\n"
+"	mov	r1, r24\n"
+"	rjmp	stream_fill\n"
+"stream_token:\n"
+"	sbrc	r24, 7\n"
+"	ldi	r16, 0xff\n"
+"	sbrc	r24, 7\n"
+"	rjmp	stream_pending\n"
+"	sbrc	r24, 6\n"
+"	ret\n"
+"	inc	r24\n"
+"	lsl	r24\n"
+"	mov	r16, r24\n"
+"	ret\n"
+"stream_pending:\n"
+"	mov	r17, r24\n"
+"	ret\n"
+"stream_copy:\n"
+"	clr	r16\n"
+"	mov	r25, r17\n"
+"	andi	r25, 0x0f\n"
+"	adiw	r24, 1\n"
+"	lsl	r24\n"
+"	rol	r25\n"
+"	movw	r22, r4\n"
+"	sub	r22, r24\n"
+"	sbc	r23, r25\n"
+"	swap	r17\n"
+"	andi	r17, 0x07\n"
+"	subi	r17, -2\n"
+"12:	movw	r30, r22\n"
+#if defined(__AVR_HAVE_LPMX__)
+"	lpm	r0, z+\n"
+"	lpm	r1, z+\n"
+#else
+"	lpm\n"
+"	mov	r25, r0\n"
+"	adiw	r30, 1\n"
+"	lpm\n"
+"	adiw	r30, 1\n"
+"	mov	r1, r0\n"
+"	mov	r0, r25\n"
+#endif
+"	movw	r22, r30\n"
+"	rcall	stream_fill\n"
+"	dec	r17\n"
+"	brne	12b\n"
+"	ret\n"
+"stream_fill:\n"
+"	movw	r30, r4\n"
+"	ldi	r25, %[cmd_buf_fill]\n"
+"	out	%[spm], r25\n"
+"	spm\n"
+"	adiw	r30, 2\n"
+"	movw	r4, r30\n"
+"	andi	r30, %[page_mask]\n"
+"	brne	14f\n"
+"	movw	r30, r4\n"
+"	sbiw	r30, 2\n"
+"	ldi	r25, %[cmd_page_write]\n"
+"	out	%[spm], r25\n"
+"	spm\n"
+"13:	in	r25, %[spm]\n" /* Wait on parts that keep running */
+"	sbrc	r25, 0\n"
+"	rjmp	13b\n"
+"14:	ret\n"
+#endif
 	:
 	:	[osccal_reg] "I"(_SFR_IO_ADDR(OSCCAL_REG)),
 		[spm] "I" (_SFR_IO_ADDR(__SPM_REG)),
 		[mcusr] "I" (_SFR_IO_ADDR(MCUSR)),
 		[cmd_exit] "M" (cmd_exit),
+		[user_end] "M" (_VECTOR_SIZE * 2),
+#ifdef RAMPZ
+		[rampz] "I" (_SFR_IO_ADDR(RAMPZ)),
+#endif
+		[cmd_buf_fill] "M" (cmd_buf_fill),
+		[cmd_page_erase] "M" (cmd_page_erase),
+		[cmd_page_write] "M" (cmd_page_write),
+#if VME_CFG_STATS
+		[stats_magic] "M" (VME_STATS_MAGIC),
+		[stats_counters] "M" (sizeof(vme_stats) - 1),
+		[stats_spm] "i" (vme_stats.spm),
+		[stats_frames] "i" (&vme_stats.frames),
+#endif
+		[cmd_stream_data] "M" (cmd_stream_data),
+		[cmd_stream_begin] "M" (cmd_stream_begin),
+		[cmd_page_verify] "M" (cmd_page_verify),
+		[cmd_verify_clear] "M" (cmd_verify_clear),
+		[page_size] "M" (SPM_PAGESIZE & 0xff),
+#ifdef RWWSRE
+		[rww_enable] "M" (_BV(RWWSRE) | 1),
+#endif
+		[page_mask] "M" (SPM_PAGESIZE - 1),
 		[rx_buf] "i" (usbRxBuf + USB_BUFSIZE + 2),
 		[usb_bufsize] "I" (USB_BUFSIZE),
 		[gpior_bl_reg] "I" (_SFR_IO_ADDR(USB_GPIOR(VME_MODE_GPIOR_IDX))),
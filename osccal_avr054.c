@@ -26,6 +26,12 @@
 /* Don't change by more than this value at once */
 #define OSCCAL_MAXD	32
 
+/* Frames averaged when choosing the final value */
+#define OSCCAL_FRAMES	4
+
+/* Single frame jitter of osccal_loop, in units of its 8 cycle loop */
+#define OSCCAL_NOISE	4
+
 /* Taken as same frequency value in both ranges by inspection */
 #define RANGE1_SWITCH 96
 #define RANGE2_SWITCH 128
@@ -75,69 +81,127 @@ static void adjust_osccal(unsigned char target)
 	}
 }
 
-static unsigned short calibrate_range(unsigned char osccal_min, unsigned char osccal_max)
+/* Sum of the deviation over a number of keep-alive frames */
+static short measure(unsigned char frames)
 {
-	unsigned char step;
-	unsigned char osccal;
-	short delta;
-	unsigned short deviation;
-	unsigned short min_deviation;
-	unsigned char best;
+	short sum = 0;
+	while (frames--)
+		sum += osccal_loop();
+	return sum;
+}
 
-	/* Binary search for ideal OSCCAL (AVR054 4.1.1)  */
-	step = (osccal_max - osccal_min + 1) / 2;
-	osccal = osccal_min + step;
+static unsigned short calibrate_range(unsigned char osccal_min, unsigned char osccal_max,
+				      unsigned char osccal)
+{
+	/* The ideal OSCCAL is between lo (runs slow) and hi (runs fast) */
+	unsigned char lo = osccal_min;
+	unsigned char hi = osccal_max;
+	bool have_lo = false;
+	bool have_hi = false;
+	short dlo = 0;
+	short dhi = 0;
+	unsigned char prev = 0;
+	short dprev = 0;
+	bool have_prev = false;
+	bool bisect;
+	short delta;
+	short next;
 
+	/*
+	 * Rather than bisecting (AVR054 4.1.1), each measurement is used to
+	 * predict the ideal OSCCAL. Until it is bracketed, extrapolate through
+	 * the last two measurements, which are then on the same side. Once it
+	 * is bracketed, interpolate between the two sides (regula falsi).
+	 * OSCCAL is monotonic within a range, but not linear, so bisect the
+	 * bracket whenever a measurement lands on the same side as the last.
+	 */
 	for (;;) {
 		adjust_osccal(osccal);
-
 		delta = osccal_loop();
 
-		if (!delta)
-			return 0;
-
-		step /= 2;
+		bisect = have_prev && (delta >= 0) == (dprev >= 0);
+		if (delta >= 0) {
+			lo = osccal;
+			dlo = delta;
+			have_lo = true;
+		} else {
+			hi = osccal;
+			dhi = delta;
+			have_hi = true;
+		}
 
-		if (!step)
+		if (have_lo && have_hi && hi - lo <= 1)
+			break;
+		/* Ideal value is outside of this range */
+		if (!have_lo && osccal == osccal_min)
+			break;
+		if (!have_hi && osccal == osccal_max)
 			break;
 
-		if (delta > 0)
-			osccal += step;
-		else
-			osccal -= step;
-	}
-
-	/* Neighbor search (AVR054 4.1.2) */
+		if (have_lo && have_hi) {
+			if (bisect)
+				next = (lo + hi + 1) / 2;
+			else
+				next = lo + (long) dlo * (hi - lo) / (dlo - dhi);
+		} else {
+			if (have_prev && delta != dprev)
+				next = osccal + (long) delta * (osccal - prev) / (dprev - delta);
+			else
+				next = (lo + hi + 1) / 2;
+			/*
+			 * A noisy pair can predict wildly, and far from the
+			 * ideal value the clock may leave the window
+			 * osccal_loop can measure, limit the step.
+			 */
+			if (next > osccal + OSCCAL_MAXD)
+				next = osccal + OSCCAL_MAXD;
+			if (next < osccal - OSCCAL_MAXD)
+				next = osccal - OSCCAL_MAXD;
+		}
 
-	/* Try two below, two above (clip to osccal_min/max) */
-	if (osccal > osccal_min + 2)
-		osccal_min = osccal - 2;
-	if (osccal < osccal_max - 2)
-		osccal_max = osccal + 2;
+		/* Stay within the bracket, measured ends are already known */
+		if (next <= lo)
+			next = lo + have_lo;
+		if (next >= hi)
+			next = hi - have_hi;
 
-	best = osccal;
-	min_deviation = 0xffff;
-	adjust_osccal(osccal_min);
-	for (osccal = osccal_min; osccal <= osccal_max; osccal++) {
-		adjust_osccal(osccal);
-		delta = osccal_loop();
-		if (!delta) {
-			return 0;
-		}
-		if (delta < 0)
-			deviation = -delta;
-		else
-			deviation = delta;
-		if (deviation <= min_deviation) {
-			min_deviation = deviation;
-			best = osccal;
-		}
-		if (osccal == 0xff)
-			break;
+		prev = osccal;
+		dprev = delta;
+		have_prev = true;
+		osccal = next;
 	}
 
-	adjust_osccal(best);
-	return min_deviation;
+	/*
+	 * Single frames are noisy, unless one of the two neighbors around the
+	 * ideal value is clearly closer, pick on an average over OSCCAL_FRAMES
+	 * frames. The deviation returned is scaled to OSCCAL_FRAMES frames.
+	 */
+	if (!have_lo || !have_hi) {
+		delta += measure(OSCCAL_FRAMES - 1);
+		return delta < 0 ? -delta : delta;
+	}
+	dhi = -dhi;
+	if (dlo > dhi + OSCCAL_NOISE) {
+		adjust_osccal(hi);
+		return dhi * OSCCAL_FRAMES;
+	}
+	if (dhi > dlo + OSCCAL_NOISE) {
+		adjust_osccal(lo);
+		return dlo * OSCCAL_FRAMES;
+	}
+	adjust_osccal(lo);
+	dlo += measure(OSCCAL_FRAMES - 1);
+	adjust_osccal(hi);
+	dhi -= measure(OSCCAL_FRAMES - 1);
+	/* hi may average slow and lo fast, compare magnitudes */
+	if (dlo < 0)
+		dlo = -dlo;
+	if (dhi < 0)
+		dhi = -dhi;
+	if (dhi <= dlo)
+		return dhi;
+	adjust_osccal(lo);
+	return dlo;
 }
 
 int main(void)
@@ -157,23 +221,20 @@ int main(void)
 	 * is approximately 10MHz and the base frequency is 8MHz (+25%).
 	 */
 #if (OSC_VER == 1) || (OSC_VER == 2) || (OSC_VER == 3)
-	calibrate_range(0, 0xff);
+	calibrate_range(0, 0xff, 0x80);
 #elif OSC_VER == 4
-	calibrate_range(0, 0x7f);
+	calibrate_range(0, 0x7f, 0x40);
 #elif OSC_VER == 5
-	unsigned short min_deviation = min_deviation;
-	unsigned char osccal = osccal;
-	unsigned char i = 0;
-	unsigned short deviation;
-again:
-	deviation = calibrate_range(i, i + 0x7f);
-	if (i == 0) {
-		i = 0x80;
-		osccal = OSCCAL_REG;
-		min_deviation = deviation;
-		goto again;
-	}
-	if (min_deviation < deviation)
+	/*
+	 * F_CPU is normally found in the high range, most of the low range
+	 * runs too slow for osccal_loop to measure. The low range is only
+	 * searched when the high range ends at its slowest value, starting
+	 * where the two ranges meet.
+	 */
+	unsigned short deviation = calibrate_range(0x80, 0xff, 0xc0);
+	unsigned char osccal = OSCCAL_REG;
+	if (osccal == 0x80 &&
+	    calibrate_range(0, RANGE1_SWITCH, RANGE1_SWITCH) > deviation)
 		/* Switch back */
 		adjust_osccal(osccal);
 #else
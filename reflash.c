@@ -19,6 +19,7 @@
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>
 #include <avr/boot.h>
+#include <util/crc16.h>
 
 #include "pagesize.h"
 #include "bitops.h"
@@ -40,12 +41,57 @@ extern unsigned char __ctors_end;
 /* End of the new bootloader code */
 extern unsigned char _etext;
 
+#ifdef REFLASH_DIFF
+/*
+ * The payload from scripts/reflash_diff.py only carries the pages that differ
+ * from the bootloader it was made against:
+ *
+ *   byte 0	Number of bootloader pages
+ *   byte 1	Serial number slot length in characters, 0 if not kept
+ *   word 1	CRC16 of the pages left out, as they are on the device
+ *   word 2	Old serial number slot, offset from the end of flash
+ *   word 3	New serial number slot, offset from the end of flash
+ *   bitmap	Pages present, LSB first, padded to a word
+ *   pages	The pages present
+ *
+ * The pages holding either serial number slot are always present.
+ */
+#define PAYLOAD		((uint16_t) &__ctors_end)
+#define PAYLOAD_SLOT_LEN (PAYLOAD + 1)
+#define PAYLOAD_CRC	(PAYLOAD + 2)
+#define PAYLOAD_OLD_SLOT (PAYLOAD + 4)
+#define PAYLOAD_NEW_SLOT (PAYLOAD + 6)
+#define PAYLOAD_MAP	(PAYLOAD + 8)
+#endif
+
+/*
+ * Word of the new bootloader at dst, the osccal words and the serial number
+ * are kept from the old, saved in page 1
+ */
+static inline __attribute__((always_inline))
+uint16_t new_word(uint16_t src, uint16_t dst, uint16_t rst)
+{
+	if (dst - rst < 4)
+		return pgm_read_word(PAGESIZE + 2 + dst - rst);
+#ifdef REFLASH_DIFF
+	dst -= FLASHEND + 1 + pgm_read_word(PAYLOAD_NEW_SLOT);
+	if (dst < 2 * pgm_read_byte(PAYLOAD_SLOT_LEN))
+		return pgm_read_word(PAGESIZE + 6 + dst);
+#endif
+	return pgm_read_word(src);
+}
+
 __attribute__((naked,section(".vectors"),noreturn)) void reflash(void)
 {
 	uint16_t src;
 	uint16_t dst;
 	uint16_t rst;
+	uint16_t i;
 	uint8_t b;
+#ifdef REFLASH_DIFF
+	uint16_t map = PAYLOAD_MAP;
+	uint8_t mask = 1;
+#endif
 
 	/*
 	 * Allocate a couple of pages at start.
@@ -82,12 +128,45 @@ __attribute__((naked,section(".vectors"),noreturn)) void reflash(void)
 		b = pgm_read_byte(FLASHEND + 1 - 4);
 	       	rst = FLASHEND + 1 - ((uint16_t) b << LOG2(PAGESIZE));
 
+#ifdef REFLASH_DIFF
+		/*
+		 * The pages left out of the payload are kept as they are, make
+		 * sure this is the bootloader the payload was made against
+		 * before touching anything. If not, return to the bootloader.
+		 */
+		b = pgm_read_byte(PAYLOAD);
+		dst = FLASHEND + 1 - ((uint16_t) b << LOG2(PAGESIZE));
+		i = 0xffff;
+		do {
+			if (!(pgm_read_byte(map) & mask)) {
+				for (src = dst; src < dst + PAGESIZE; src++)
+					i = _crc16_update(i, pgm_read_byte(src));
+			}
+			mask <<= 1;
+			if (!mask) {
+				mask = 1;
+				map++;
+			}
+			dst += PAGESIZE;
+		} while (--b);
+		if (i != pgm_read_word(PAYLOAD_CRC))
+			asm("rjmp 0");
+		map = PAYLOAD_MAP;
+		mask = 1;
+#endif
+
 		/* Add a jump straight to reflash */
 		boot_page_fill(PAGESIZE,
 			0xc000 | ((((uint16_t) (PAGESIZE * 2 - PAGESIZE) >> 1) - 1) & 0xfff));
 		/* Save the osccal programming sequence in the last page */
 		boot_page_fill(PAGESIZE + 2, pgm_read_word(rst));
 		boot_page_fill(PAGESIZE + 4, pgm_read_word(rst + 2));
+#ifdef REFLASH_DIFF
+		/* And the serial number after them */
+		src = FLASHEND + 1 + pgm_read_word(PAYLOAD_OLD_SLOT);
+		for (i = 0; i < 2 * pgm_read_byte(PAYLOAD_SLOT_LEN); i += 2)
+			boot_page_fill(PAGESIZE + 6 + i, pgm_read_word(src + i));
+#endif
 		wdt_reset();
 		boot_page_erase(PAGESIZE);
 		wdt_reset();
@@ -102,30 +181,52 @@ __attribute__((naked,section(".vectors"),noreturn)) void reflash(void)
 	 * The configuration block at the end of flash gives the start address
 	 * of the new bootloader.
 	 */
+#ifdef REFLASH_DIFF
+	b = pgm_read_byte(PAYLOAD);
+	src = PAYLOAD_MAP + (((b + 15) >> 3) & ~1);
+#else
 	b = pgm_read_byte((uint16_t) &_etext - 4);
+	src = (uint16_t) &__ctors_end;
+#endif
 	rst = FLASHEND + 1 - ((uint16_t) b << LOG2(PAGESIZE));
 	dst = rst;
-	src = PAGESIZE + 2; /* Start from osccal words */
 
-	/* Erase the bootloader and write the new one */
+	/*
+	 * Write the new bootloader, leaving pages that already match alone.
+	 * A reflash that was interrupted resumes with the first page that
+	 * didn't make it.
+	 */
 	do {
-		unsigned char i;
-		if (!(dst % PAGESIZE)) {
-			wdt_reset();
-			boot_page_erase(dst);
+#ifdef REFLASH_DIFF
+		uint8_t present = pgm_read_byte(map) & mask;
+		mask <<= 1;
+		if (!mask) {
+			mask = 1;
+			map++;
 		}
-
-		for (i = 0; i < SPM_PAGESIZE / 2; i++) {
-			boot_page_fill(dst, pgm_read_word(src));
-			src += 2;
-			dst += 2;
-			if (src == PAGESIZE + 6)
-				src = (uint16_t) &__ctors_end + 4;
+		if (!present) {
+			dst += PAGESIZE;
+			continue;
 		}
+#endif
+		for (i = 0; i < PAGESIZE; i += 2)
+			if (new_word(src + i, dst + i, rst) != pgm_read_word(dst + i))
+				break;
 
-		wdt_reset();
-		boot_page_write(dst - SPM_PAGESIZE);
-	} while (src < (uint16_t) &_etext);
+		if (i < PAGESIZE) {
+			wdt_reset();
+			boot_page_erase(dst);
+			for (i = 0; i < PAGESIZE; i += 2) {
+				boot_page_fill(dst + i, new_word(src + i, dst + i, rst));
+				if (!((i + 2) % SPM_PAGESIZE)) {
+					wdt_reset();
+					boot_page_write(dst + i + 2 - SPM_PAGESIZE);
+				}
+			}
+		}
+		src += PAGESIZE;
+		dst += PAGESIZE;
+	} while (--b);
 
 	/*
 	 * Make sure the page before the bootloader is empty. This ensures
@@ -1,8 +1,22 @@
 #!/usr/bin/python3
 
 import sys
+import zlib
 
 areas = {}
+syms = {}
+
+report = False
+abi_hash = False
+args = sys.argv[1:]
+while args:
+    arg = args.pop(0)
+    if arg == '--report':
+        report = True
+    elif arg == '--hash':
+        abi_hash = True
+    else:
+        raise Exception(f'Unknown argument "{arg}"')
 
 for line in sys.stdin:
     line = line.split()
@@ -12,32 +26,111 @@ for line in sys.stdin:
     addr, _type, sym = line
     addr = int(addr, 0x10)
     areas.setdefault(_type, []).append((addr, sz, sym))
+    syms[sym] = addr
 
 for a in areas.values():
     a.sort(key=lambda n: n[0])
 
+# Routines reached through bootloader vectors (bl_vector in vectors.S)
+exports = [(addr, sym.removeprefix('__bl_')) for addr, sz, sym in areas['T']
+        if sym.startswith('__bl_') and not sym.startswith('__bl___vector_')]
+
+# With VME_CFG_DIRECT_ABI these are exported at their real addresses
+direct = ('usbInit', 'usbPoll', 'usbSetInterrupt', 'usbGenericSetInterrupt')
+direct_abi = '__vme_direct_abi' in syms
+if direct_abi:
+    exports = [(syms.get(sym, addr) if sym in direct else addr, sym)
+            for addr, sym in exports]
+
+# RAM below __bss_end is V-USB state shared with the user program. State only
+# used in bootloader mode is kept in .noinit after it and is not reserved in
+# the user program.
+bss = {sym: addr for addr, sz, sym in areas.get('B', []) if sym.startswith('__')}
+shared_start = bss.get('__bss_start', 0)
+shared_end = bss.get('__bss_end', shared_start)
+shared = []
+overlay = []
+for addr, sz, sym in areas.get('B', []):
+    if sym.startswith('__'):
+        continue
+    (shared if addr < shared_end else overlay).append((addr, sz, sym))
+overlay_end = max([addr + sz for addr, sz, sym in overlay], default=shared_end)
+
+# Hash of everything a directly linked user program depends on. It is taken
+# from the first pass link (main_reloc.elf) and stored in the info block by
+# the final link, routines are hashed as offsets from __init and the end of
+# flash as the first pass places them elsewhere, plus the bootloader size.
+def layout_hash(pages):
+    layout = [pages]
+    for addr, sym in exports:
+        if sym in direct:
+            layout.append((sym, addr - syms['__init']))
+        else:
+            layout.append((sym, syms['__end_vectors_end'] - addr))
+    layout += shared
+    return (zlib.crc32(repr(layout).encode()) & 0xffff) or 1
+
+if abi_hash:
+    pagesize = syms['__pagesize']
+    print(f'{layout_hash((syms["__data_load_end"] + pagesize - 1) // pagesize):x}')
+    sys.exit(0)
+
+if direct_abi and layout_hash(syms['__bl_num_pages']) != syms['__vme_abi_hash']:
+    raise Exception('ABI hash does not match the final bootloader layout')
+
+if report:
+    # nm reports RAM addresses with the 0x800000 data space offset
+    print(f'Shared RAM:          0x{shared_start & 0xffff:04x}-0x{shared_end & 0xffff:04x}, {shared_end - shared_start} bytes')
+    for addr, sz, sym in shared:
+        print(f'  0x{addr & 0xffff:04x} {sz:4d} {sym}')
+    print(f'Bootloader only RAM: 0x{shared_end & 0xffff:04x}-0x{overlay_end & 0xffff:04x}, {overlay_end - shared_end} bytes')
+    for addr, sz, sym in overlay:
+        print(f'  0x{addr & 0xffff:04x} {sz:4d} {sym}')
+    sys.exit(0)
+
+# Let user programs test which routines the bootloader provides
+for addr, sym in exports:
+    print(f'#define VME_HAVE_{sym} 1')
+if direct_abi:
+    print(f'#define VME_ABI_HASH 0x{syms["__vme_abi_hash"]:04x}')
+if 'vmeStageSpm' in syms:
+    # Staged pages go below the header, the page before the last user page
+    pagesize = syms['__pagesize']
+    last = syms['user_reset'] & ~(pagesize - 1)
+    print(f'#define VME_STAGE_PAGESIZE {pagesize}')
+    print(f'#define VME_STAGE_HEADER 0x{last - pagesize:x}')
+    print('#define VME_STAGE_MAGIC 0x5356')
+if 'vme_stats' in syms:
+    # Counters are in the overlay, they are only valid until the user
+    # program reuses that RAM
+    print(f'#define VME_STATS_ADDR 0x{syms["vme_stats"] & 0xffff:04x}')
+    print('#define VME_STATS_MAGIC 0x5a')
+
 print('__attribute__((naked,used)) static void __bl_addresses(void)')
 print('{')
 print('\tasm(')
 
 print(r'".pushsection .bl_addresses, \"\", @note\n"')
-for addr, sz, sym in areas['T']:
-    if not sym.startswith('__bl_') or sym.startswith('__bl___vector_'):
-        continue
-    sym = sym.removeprefix('__bl_')
+for addr, sym in exports:
     print(f'".set {sym}, 0x{addr:x} + __TEXT_REGION_ORIGIN__\\n"')
     print(f'".type {sym}, @function\\n"')
     print(f'".global {sym}\\n"')
+if direct_abi:
+    print(f'".set __vme_abi_hash, 0x{syms["__vme_abi_hash"]:x}\\n"')
+    print(f'".global __vme_abi_hash\\n"')
 print(r'".popsection\n"')
 
+# Reserve the shared state at the same addresses, padding any holes
 print(r'".pushsection .bss\n"')
-for addr, sz, sym in areas['B']:
-    if sym.startswith('__bss_'):
-        continue
+pos = shared_start
+for addr, sz, sym in shared:
+    if addr > pos:
+        print(f'".zero 0x{addr - pos:x}\\n"')
     print(f'".set {sym}, 0x{addr:x}\\n"')
     print(f'".size {sym}, 0x{sz:x}\\n"')
     print(f'".zero 0x{sz:x}\\n"')
     print(f'".global {sym}\\n"')
+    pos = max(pos, addr + sz)
 print(r'".popsection\n"')
 print('\t);')
 print('}')
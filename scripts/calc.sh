@@ -30,6 +30,9 @@ case "$1" in
 "__bl_num_pages")
 	val=$pages
 	;;
+"__pagesize")
+	val=$__pagesize
+	;;
 esac
 
 printf "%x\n" $val
@@ -0,0 +1,126 @@
+#!/usr/bin/python3
+#
+# Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Descriptors of a user program that differ from the bootloader's, as C
+# source replacing the user program's usbdesc.c:
+#
+#   scripts/desc_dedup.py vmeiosis/main.elf usbdesc.o > usbdesc_dedup.c
+#
+# In user mode a descriptor request is looked up in the user program's
+# usbDescriptors first and then in the bootloader's. Entries are matched by
+# type and by index among entries of that type. The index is not reset for
+# the second pass, it is reduced by the number of entries of that type in
+# the user program. So with k entries of a type kept, index i >= k returns
+# the bootloader's entry i - k, and a tail of a type can only be left to the
+# bootloader if it matches the start of the bootloader's entries of that
+# type. A configuration descriptor is kept or dropped together with the
+# interface, HID and endpoint descriptors that follow it.
+
+import struct
+import sys
+
+names = {1: 'Device', 2: 'Configuration', 3: 'String'}
+
+def elf_symbol(fn, name):
+    '''Contents of a symbol's section starting at the symbol'''
+    with open(fn, 'rb') as f:
+        data = f.read()
+    if data[:4] != b'\x7fELF' or data[4] != 1:
+        raise Exception(f'{fn} is not a 32 bit ELF file')
+    e_type, = struct.unpack_from('<H', data, 0x10)
+    e_shoff, = struct.unpack_from('<I', data, 0x20)
+    e_shentsize, e_shnum = struct.unpack_from('<HH', data, 0x2e)
+    # name, type, flags, addr, offset, size, link, info, addralign, entsize
+    sections = [struct.unpack_from('<10I', data, e_shoff + i * e_shentsize)
+            for i in range(e_shnum)]
+    for sh in sections:
+        if sh[1] != 2: # SHT_SYMTAB
+            continue
+        strtab = sections[sh[6]][4]
+        for off in range(sh[4], sh[4] + sh[5], 16):
+            st_name, st_value, st_size, st_info, st_other, st_shndx = \
+                    struct.unpack_from('<IIIBBH', data, off)
+            end = data.index(b'\0', strtab + st_name)
+            if data[strtab + st_name:end].decode() != name:
+                continue
+            sec = sections[st_shndx]
+            # Relocatable objects give the offset into the section
+            offset = st_value - (sec[3] if e_type != 1 else 0)
+            return data[sec[4] + offset:sec[4] + sec[5]]
+    raise Exception(f'No {name} in {fn}')
+
+def entries(blob):
+    '''(type, bytes) groups as walked by usbCustomDriverDescriptor'''
+    ret = []
+    pos = 0
+    while pos < len(blob) and blob[pos]:
+        n = blob[pos]
+        if n < 2 or pos + n > len(blob):
+            raise Exception(f'Bad descriptor length {n} at offset {pos}')
+        _type = blob[pos + 1]
+        if _type in names or not ret:
+            ret.append((_type, blob[pos:pos + n]))
+        else:
+            # Inline in the configuration descriptor
+            ret[-1] = (ret[-1][0], ret[-1][1] + blob[pos:pos + n])
+        pos += n
+    return ret
+
+def dedup(user, boot):
+    '''Entries of user to keep, every index the user program served still
+    returns the same descriptor'''
+    boot_by_type = {}
+    for _type, data in boot:
+        boot_by_type.setdefault(_type, []).append(data)
+    count = {}
+    for _type in dict.fromkeys(t for t, d in user):
+        same = [d for t, d in user if t == _type]
+        boot_same = boot_by_type.get(_type, [])
+        # Fewest kept entries such that the rest are served by the
+        # bootloader's first entries of that type
+        count[_type] = next(k for k in range(len(same) + 1)
+                if same[k:] == boot_same[:len(same) - k])
+    keep = []
+    for _type, data in user:
+        if count[_type]:
+            keep.append((_type, data))
+            count[_type] -= 1
+    return keep
+
+def main(argv):
+    if len(argv) != 3:
+        raise Exception('Usage: desc_dedup.py <main.elf> <usbdesc.o>')
+    boot = entries(elf_symbol(argv[1], 'usbDescriptors'))
+    user = entries(elf_symbol(argv[2], 'usbDescriptors'))
+    keep = dedup(user, boot)
+
+    saved = sum(len(d) for t, d in user) - sum(len(d) for t, d in keep)
+    print(f'/* Generated by desc_dedup.py from {argv[2]} against {argv[1]}')
+    print(f' * {len(user) - len(keep)} of {len(user)} descriptors left to the bootloader, {saved} bytes saved */')
+    print('#include <avr/pgmspace.h>')
+    print()
+    print('PROGMEM const char usbDescriptors[] = {')
+    for t, d in keep:
+        print(f'    /* {names.get(t, f"Type 0x{t:02x}")} */')
+        for pos in range(0, len(d), 12):
+            print('    ' + ' '.join(f'0x{b:02x},' for b in d[pos:pos + 12]))
+    print('    0, /* Final length 0, indicates end */')
+    print('};')
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -5,6 +5,8 @@ import elftools.elf.constants
 import elftools.elf.structs
 import elftools.construct.core
 
+from sparse_image import SparseImage
+
 mcus = {
     'avr1': 1,
     'avr2': 2,
@@ -135,6 +137,10 @@ class FmtElf:
     def __init__(self, part):
         self.part = part
         _id = part['id']
+        if _id is None:
+            # Part described by the bootloader info block, mcuid unknown
+            self.mcuid = None
+            return
         ids = [mcuid for mcuid, parts in mcuids.items() if _id in parts]
         if not ids:
             raise Exception(f'Unknown mcuid for {part.get("desc", _id)}')
@@ -145,6 +151,9 @@ class FmtElf:
         return 100
 
     def op_output_bin(self, f, segments):
+        if self.mcuid is None:
+            raise Exception(f'Unknown mcuid for {self.part.get("desc")}')
+        segments = list(segments)
         seg_areas = []
         for seg in segments:
             seg_area = None
@@ -311,12 +320,12 @@ class FmtElf:
         ef = elftools.elf.elffile.ELFFile(f)
         if ef['e_machine'] != 'EM_AVR':
             raise Exception(f'Unexpected architecture: {ef["e_machine"]}')
-        if ef['e_flags'] & 0x7f != self.mcuid:
+        if self.mcuid is not None and ef['e_flags'] & 0x7f != self.mcuid:
             raise Exception(f'Unexpected mcuid in ELF Phdr flags: {ef.eflag & 0x7f}')
-        segments = []
+        image = SparseImage()
         for seg in ef.iter_segments('PT_LOAD'):
             if seg['p_filesz']:
-                segments.append((seg['p_paddr'], seg.data()))
-        return segments
+                image.put(seg['p_paddr'], seg.data())
+        return image
 
 formats = [FmtElf]
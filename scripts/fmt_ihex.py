@@ -2,6 +2,8 @@
 
 import intelhex
 
+from sparse_image import SparseImage
+
 class FmtIHex:
     id = 'i'
     desc = 'ihex'
@@ -21,6 +23,6 @@ class FmtIHex:
 
     def op_input_file(self, f):
         hf = intelhex.IntelHex(f)
-        return [(seg[0], hf.gets(seg[0], seg[1] - seg[0])) for seg in hf.segments()]
+        return SparseImage((seg[0], hf.gets(seg[0], seg[1] - seg[0])) for seg in hf.segments())
 
 formats = [FmtIHex]
@@ -4,6 +4,8 @@ import re
 import math
 import struct
 
+from sparse_image import SparseImage
+
 def uwidth(v):
     return [x for x in [8, 16, 32, 64] if v < 1 << x][0] // 8
 
@@ -124,7 +126,7 @@ class FmtImm:
         raise Exception('Immediate format not supported for output')
 
     def op_input_str(self, s):
-        return [(0, encode_line(s, 0))]
+        return SparseImage([(0, encode_line(s, 0))])
 
 
 class FmtNum:
@@ -132,8 +134,7 @@ class FmtNum:
         self.part = part
 
     def op_detect_file(self, f):
-        start, data = self.op_input_file(f)
-        return 20 if len(data) > 0 else 0
+        return 20 if len(self.op_input_file(f)) > 0 else 0
 
     def op_output_file(self, f, segments):
         prefix, fmt = {2: ('0b', 'b'), 8: ('0', 'o'), 10: ('', 'd'), 16: ('0x', 'x')}[self.radix]
@@ -153,7 +154,7 @@ class FmtNum:
         data = b''
         for line in f.readlines():
             data += encode_line(line.strip(), 0, terminator=r'\s*(,\s*#.*|,\s*|#.*|$)')
-        return [(0, data)]
+        return SparseImage([(0, data)])
 
 class FmtBin(FmtNum):
     id = 'b'
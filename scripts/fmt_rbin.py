@@ -1,5 +1,7 @@
 #!/usr/bin/python3
 
+from sparse_image import SparseImage
+
 class FmtRBin:
     id = 'r'
     desc = 'rbin'
@@ -20,6 +22,6 @@ class FmtRBin:
             f.write(seg[1])
 
     def op_input_bin(self, f):
-        return [(0, f.read())]
+        return SparseImage([(0, f.read())])
 
 formats = [FmtRBin]
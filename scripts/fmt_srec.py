@@ -2,6 +2,8 @@
 
 import re
 
+from sparse_image import SparseImage
+
 class FmtSrec:
     id = 's'
     desc = 'ihex'
@@ -56,7 +58,7 @@ class FmtSrec:
         f.write(f'S{_type}' + h.hex().upper() + '\n')
 
     def op_input_file(self, f):
-        image = {}
+        image = SparseImage()
         lineno = 0
         rec_count = 0
         for line in f.readlines():
@@ -82,26 +84,11 @@ class FmtSrec:
                 data = data[addrlen:]
                 if _type in (1, 2, 3):
                     rec_count += 1
-                    for o, d in enumerate(data):
-                        image[addr + o] = d
+                    image.put(addr, data)
                 elif _type in (5, 6):
                     if rec_count != addr:
                         raise Exception('File contains missing records')
 
-        segments = []
-        seg_start = None
-        for addr, b in image.items():
-            if seg_start is None:
-                seg_start = addr
-                seg_data = []
-            elif addr != seg_curr + 1:
-                segments.append((seg_start, seg_data))
-                seg_start = addr
-                seg_data = []
-            seg_curr = addr
-            seg_data.append(b)
-        if seg_start is not None:
-            segments.append((seg_start, bytes(seg_data)))
-        return segments
+        return image
 
 formats = [FmtSrec]
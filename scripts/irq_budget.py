@@ -0,0 +1,124 @@
+#!/usr/bin/python3
+#
+# Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Worst case cycles from the USB interrupt to the V-USB sync loop, read from
+# the disassembly of main.elf on stdin:
+#
+#   avr-objdump -d main.elf | scripts/irq_budget.py --f-cpu 16500000 --flashend 0x1fff
+#
+# The path is the interrupt response plus the instruction the user program
+# is in the middle of (--user-latency, raise it to cover cli sections), the
+# patched user vector, the bootloader vector at the end of flash (skipped
+# with vmedude --direct-irq) and the V-USB handler up to waitForJ. It has to
+# be in the sync loop within the first 6 bits of the SYNC pattern so the
+# final KK can still be found. Conditional branches count as taken and are
+# followed on the fall through path, skip instructions count as skipping.
+
+import re
+import sys
+
+cycles = {
+    'push': 2, 'pop': 2, 'ld': 2, 'ldd': 2, 'st': 2, 'std': 2, 'lds': 2,
+    'sts': 2, 'adiw': 2, 'sbiw': 2, 'rjmp': 2, 'ijmp': 2, 'sbi': 2, 'cbi': 2,
+    'mul': 2, 'muls': 2, 'mulsu': 2, 'fmul': 2, 'fmuls': 2, 'fmulsu': 2,
+    'lpm': 3, 'elpm': 3, 'jmp': 3, 'rcall': 3, 'icall': 3, 'call': 4,
+    'ret': 4, 'reti': 4, 'sbis': 2, 'sbic': 2, 'sbrs': 2, 'sbrc': 2,
+    'cpse': 2,
+}
+
+def main(argv):
+    f_cpu = None
+    flashend = 0x1fff
+    user_latency = 4
+    args = argv[1:]
+    while args:
+        arg = args.pop(0)
+        if arg == '--f-cpu':
+            f_cpu = int(args.pop(0), 0)
+        elif arg == '--flashend':
+            flashend = int(args.pop(0), 0)
+        elif arg == '--user-latency':
+            user_latency = int(args.pop(0), 0)
+        else:
+            raise Exception(f'Unknown argument "{arg}"')
+    if f_cpu is None:
+        raise Exception('--f-cpu is required')
+
+    labels = {}
+    insns = {}
+    for line in sys.stdin:
+        m = re.match(r'^([0-9a-f]+) <(.+)>:$', line)
+        if m:
+            labels[m.group(2)] = int(m.group(1), 16)
+            continue
+        m = re.match(r'^\s+([0-9a-f]+):\t((?:[0-9a-f]{2} )+)\s*\t(\S+)\s*([^;]*)(?:;\s*0x([0-9a-f]+))?', line)
+        if m:
+            addr = int(m.group(1), 16)
+            target = int(m.group(5), 16) if m.group(5) else None
+            insns[addr] = (len(m.group(2).split()), m.group(3), target)
+
+    vector = next((name for name in labels if name.startswith('__bl___vector_')), None)
+    if vector is None:
+        print('No USB interrupt vector in the bootloader, nothing to check')
+        return 0
+    size, op, isr = insns[labels[vector]]
+
+    # Parts past 128k push a 3 byte PC
+    response = 5 if flashend > 0x1ffff else 4
+    user_vector = 3 if flashend > 0x1fff else 2
+
+    handler = 0
+    addr = isr
+    # Only straight line code and forward branches are walked, anything else
+    # before the sync loop cannot be counted
+    stops = {labels[name] for name in labels if name.startswith('waitForJ')}
+    while addr not in stops:
+        if addr not in insns:
+            raise Exception(f'USB interrupt walk left the disassembly at 0x{addr:x} before waitForJ')
+        size, op, target = insns[addr]
+        if op.startswith('br') and op != 'break':
+            handler += 2
+            if target is not None and target <= addr:
+                raise Exception(f'USB interrupt walk stopped at the {op} at 0x{addr:x}, short of waitForJ')
+        elif op in ('rjmp', 'jmp'):
+            handler += cycles[op]
+            if target is None or target <= addr:
+                raise Exception(f'USB interrupt walk stopped at the {op} at 0x{addr:x}, short of waitForJ')
+            addr = target
+            continue
+        else:
+            handler += cycles.get(op, 1)
+        addr += size
+
+    limit = 6 * f_cpu // 1500000
+    entry = response + user_latency + user_vector
+    chained = entry + 2 + handler
+    direct = entry + handler
+    print(f'USB interrupt entry at {f_cpu} Hz, limit {limit} cycles')
+    print(f'  response and user latency  {response + user_latency:3d}')
+    print(f'  user vector                {user_vector:3d}')
+    print(f'  bootloader vector            2 (not with --direct-irq)')
+    print(f'  handler to sync loop       {handler:3d}')
+    print(f'  chained                    {chained:3d}, margin {limit - chained}')
+    print(f'  direct                     {direct:3d}, margin {limit - direct}')
+    if chained > limit:
+        print('USB interrupt entry exceeds the V-USB sync budget')
+        return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,109 @@
+#!/usr/bin/python3
+#
+# Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Payload for reflash.c built with REFLASH_DIFF, the pages of the new
+# bootloader that differ from the one running on the device:
+#
+#   scripts/reflash_diff.py --page-size 64 old/main.bin main.bin > main_diff.bin
+#
+# Both images are main.bin files, they end at the end of flash. The first
+# page of either bootloader holds the osccal words that differ per device
+# and is always sent. So are the pages holding the serial number slot
+# (VME_SERIAL_SLOT_LEN) of either build, the device keeps its serial. The
+# pages left out are covered by a CRC16 that the device checks against its
+# flash before changing anything.
+
+import sys
+import vmeiosis
+from sparse_image import SparseImage
+
+def crc16(crc, data):
+    # _crc16_update() from avr-libc
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xa001 if crc & 1 else crc >> 1
+    return crc
+
+def main(argv):
+    page_size = None
+    args = argv[1:]
+    files = []
+    while args:
+        arg = args.pop(0)
+        if arg == '--page-size':
+            page_size = int(args.pop(0), 0)
+        else:
+            files.append(arg)
+    if page_size is None or len(files) != 2:
+        raise Exception('Usage: reflash_diff.py --page-size <n> <old.bin> <new.bin>')
+
+    with open(files[0], 'rb') as f:
+        old = f.read()
+    with open(files[1], 'rb') as f:
+        new = f.read()
+    for fn, data in zip(files, (old, new)):
+        if len(data) % page_size or data[-4] != len(data) // page_size:
+            raise Exception(f'{fn} is not a bootloader image with {page_size} byte pages')
+
+    # Slot addresses as offsets from the end of flash
+    slots = []
+    for fn, data in zip(files, (old, new)):
+        found = vmeiosis.serial_slots(SparseImage([(-len(data), data)]))
+        if len(found) > 1:
+            raise Exception(f'{fn} has {len(found)} serial number slots')
+        slots += found
+    slot_len = 0
+    keep = set()
+    if len(slots) == 2:
+        slot_len = slots[0][1]
+        if slots[1][1] != slot_len:
+            raise Exception('Serial number slot changed length')
+        if 6 + 2 * slot_len > page_size:
+            raise Exception(f'Serial number slot does not fit the {page_size} byte save page')
+    for addr, n in slots:
+        for a in range(addr, addr + 2 * n, 2):
+            keep.add((len(new) + a) // page_size)
+
+    pages = len(new) // page_size
+    present = []
+    crc = 0xffff
+    for n in range(pages):
+        page = new[n * page_size:(n + 1) * page_size]
+        # Offset of the same flash address in the old bootloader
+        offset = len(old) - len(new) + n * page_size
+        if n and n not in keep and offset > 0 and old[offset:offset + page_size] == page:
+            crc = crc16(crc, page)
+        else:
+            present.append(n)
+
+    bitmap = bytearray((pages + 15) // 16 * 2)
+    for n in present:
+        bitmap[n // 8] |= 1 << (n % 8)
+    # Old and new slot as 16 bit offsets from the end of flash
+    slot_addrs = [a & 0xffff for a, n in slots] if slot_len else [0, 0]
+    out = bytes([pages, slot_len]) + crc.to_bytes(2, 'little')
+    out += b''.join(a.to_bytes(2, 'little') for a in slot_addrs) + bytes(bitmap)
+    for n in present:
+        out += new[n * page_size:(n + 1) * page_size]
+
+    sys.stderr.write(f'{len(present)} of {pages} pages changed, {len(out)} byte payload\n')
+    sys.stdout.buffer.write(out)
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
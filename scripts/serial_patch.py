@@ -0,0 +1,39 @@
+#!/usr/bin/python3
+#
+# Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Fill the serial number slot (VME_SERIAL_SLOT_LEN) of an ihex image, for
+# bootloader images programmed with avrdude:
+#
+#   scripts/serial_patch.py main.hex main_serial.hex FX000123
+
+import sys
+import fmt_ihex
+import vmeiosis
+
+def main(argv):
+    if len(argv) != 4:
+        raise Exception('Usage: serial_patch.py <in.hex> <out.hex> <serial>')
+    fmt = fmt_ihex.FmtIHex(None)
+    with open(argv[1]) as f:
+        image = fmt.op_input_file(f)
+    image = vmeiosis.patch_serial(image, argv[3])
+    with open(argv[2], 'w') as f:
+        fmt.op_output_file(f, image)
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,180 @@
+#!/usr/bin/python3
+#
+# Copyright (C) 2024 Russ Dill <russ.dill@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+import bisect
+
+class SparseImage:
+    '''
+    Memory image stored as sorted, non-overlapping, non-adjacent extents.
+    Iterating yields (start, data) pairs so an image can be used anywhere
+    a list of segments was previously accepted. Extents are found by
+    bisecting their starts, but put() is linear in the number of extents
+    when it inserts or merges, only sequential records that extend the last
+    extent are cheap.
+    '''
+    def __init__(self, segments=()):
+        self.starts = []
+        self.extents = []
+        for start, data in segments:
+            self.put(start, data)
+
+    def __iter__(self):
+        return zip(self.starts, self.extents)
+
+    def __len__(self):
+        return sum(len(data) for data in self.extents)
+
+    def __bool__(self):
+        return bool(self.starts)
+
+    def __repr__(self):
+        s = ', '.join(f'0x{start:x}+0x{len(data):x}' for start, data in self)
+        return f'SparseImage({s})'
+
+    @property
+    def start(self):
+        return self.starts[0] if self.starts else 0
+
+    @property
+    def end(self):
+        return self.starts[-1] + len(self.extents[-1]) if self.starts else 0
+
+    def copy(self):
+        ret = SparseImage()
+        ret.starts = list(self.starts)
+        ret.extents = [bytearray(data) for data in self.extents]
+        return ret
+
+    def put(self, start, data):
+        '''Overlay data at start, later data replaces earlier data'''
+        if not len(data):
+            return
+        end = start + len(data)
+
+        # Common case for sequential records, append to the last extent
+        if self.starts and start == self.end:
+            self.extents[-1] += data
+            return
+
+        # First extent that ends at or after start (adjacent extents merge)
+        i = bisect.bisect_right(self.starts, start) - 1
+        if i < 0 or self.starts[i] + len(self.extents[i]) < start:
+            i += 1
+        # One past the last extent that starts at or before end
+        j = bisect.bisect_right(self.starts, end)
+
+        if i == j:
+            self.starts.insert(i, start)
+            self.extents.insert(i, bytearray(data))
+            return
+
+        first_start = self.starts[i]
+        first = self.extents[i]
+        if j - i == 1 and first_start <= start and end <= first_start + len(first):
+            # Entirely contained within an existing extent
+            first[start - first_start:end - first_start] = data
+            return
+
+        last_start = self.starts[j - 1]
+        last = self.extents[j - 1]
+        merged = bytearray()
+        if first_start < start:
+            merged += first[:start - first_start]
+        merged += data
+        if last_start + len(last) > end:
+            merged += last[end - last_start:]
+        self.starts[i:j] = [min(first_start, start)]
+        self.extents[i:j] = [merged]
+
+    def update(self, other):
+        '''Overlay all extents of another image onto this one'''
+        for start, data in other:
+            self.put(start, data)
+
+    def _find(self, start, end):
+        '''Index range of extents overlapping [start, end)'''
+        i = bisect.bisect_right(self.starts, start) - 1
+        if i < 0 or self.starts[i] + len(self.extents[i]) <= start:
+            i += 1
+        j = bisect.bisect_left(self.starts, end)
+        return i, j
+
+    def slice(self, start, end):
+        '''Image containing only the data within [start, end)'''
+        ret = SparseImage()
+        i, j = self._find(start, end)
+        for idx in range(i, j):
+            s = self.starts[idx]
+            data = self.extents[idx]
+            lo = max(start, s)
+            hi = min(end, s + len(data))
+            ret.starts.append(lo)
+            ret.extents.append(data[lo - s:hi - s])
+        return ret
+
+    def shift(self, offset):
+        '''Image with every extent moved by offset'''
+        ret = SparseImage()
+        ret.starts = [start + offset for start in self.starts]
+        ret.extents = [bytearray(data) for data in self.extents]
+        return ret
+
+    def get(self, start, length, fill=0xff):
+        '''Contiguous bytes covering [start, start + length), holes filled'''
+        ret = bytearray([fill]) * length
+        i, j = self._find(start, start + length)
+        for idx in range(i, j):
+            s = self.starts[idx]
+            data = self.extents[idx]
+            lo = max(start, s)
+            hi = min(start + length, s + len(data))
+            ret[lo - start:hi - start] = data[lo - s:hi - s]
+        return ret
+
+    def contains(self, start, end):
+        '''True if any data is present within [start, end)'''
+        i, j = self._find(start, end)
+        return i < j
+
+    def split(self, regions):
+        '''
+        Divide the image along region boundaries. regions is a list of
+        (start, length, name) tuples, yields (name, region start, image)
+        for every region containing data.
+        '''
+        for rstart, rlen, name in regions:
+            sub = self.slice(rstart, rstart + rlen)
+            if sub:
+                yield name, rstart, sub
+
+    def strip(self, fill=0xff, align=1):
+        '''
+        Image with leading/trailing fill removed from every extent,
+        extents that contain only fill are dropped. align keeps the
+        resulting extents aligned (eg, 2 for flash words).
+        '''
+        ret = SparseImage()
+        f = bytes([fill])
+        for start, data in self:
+            end = start + len(data.rstrip(f))
+            start = end - len(data[:end - start].lstrip(f))
+            if start == end:
+                continue
+            start -= start % align
+            end += -end % align
+            ret.put(start, self.get(start, end - start, fill))
+        return ret
@@ -0,0 +1,60 @@
+#!/usr/bin/python3
+#
+# Copyright (C) 2024 Russ Dill <russ.dill@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Pages of a user program image for a running user program to stage through
+# vmeStageSpm(), for bootloaders built with VME_CFG_STAGING:
+#
+#   scripts/stage_image.py --page-size 64 main.hex user.hex > stage.bin
+#
+# main.hex is the bootloader on the device, the layout is taken from it. The
+# output is a list of records in the order they must be written, each a
+# 16 bit little endian flash address followed by one page. The user program
+# receives them over its own USB requests and writes each one as described
+# in README.md.
+
+import sys
+import fmt_ihex
+import vmeiosis
+
+def main(argv):
+    page_size = None
+    args = argv[1:]
+    files = []
+    while args:
+        arg = args.pop(0)
+        if arg == '--page-size':
+            page_size = int(args.pop(0), 0)
+        else:
+            files.append(arg)
+    if page_size is None or len(files) != 2:
+        raise Exception('Usage: stage_image.py --page-size <n> <main.hex> <user.hex>')
+
+    fmt = fmt_ihex.FmtIHex(None)
+    with open(files[0]) as f:
+        boot = fmt.op_input_file(f)
+    with open(files[1]) as f:
+        image = fmt.op_input_file(f)
+    layout = vmeiosis.StageLayout(boot, page_size)
+    pages = vmeiosis.stage_pages(layout, image)
+
+    out = b''.join(addr.to_bytes(2, 'little') + data for addr, data in pages)
+    sys.stderr.write(f'{len(pages)} pages to stage from 0x{pages[0][0]:x}\n')
+    sys.stdout.buffer.write(out)
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,1639 @@
+#
+# Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+import importlib
+import re
+import struct
+import sys
+import time
+import avrdude_conf
+from sparse_image import SparseImage
+
+def hexdump(src, length=16, sep='.', offset=0):
+    FILTER = ''.join([(len(repr(chr(x))) == 3) and chr(x) or sep for x in range(256)])
+    lines = []
+    last_chars = None
+    was_continue = False
+    for c in range(0, len(src), length):
+        chars = src[c: c + length]
+        hex_ = ' '.join([f'{x:02x}' for x in chars])
+        if len(hex_) > 24:
+            hex_ = ' '.join([hex_[:24], hex_[24:]])
+        printable = ''.join([str((x <= 127 and FILTER[x]) or sep) for x in chars])
+        if chars == last_chars:
+            if not was_continue:
+                lines.append('*')
+                was_continue = True
+        else:
+            lines.append(f'{c+offset:08x}  {hex_:{length * 3}}  |{printable:{length}}|')
+            was_continue = False
+        last_chars = chars
+    if was_continue:
+        c = len(src) - (len(src) % -length)
+        lines.append(f'{c+offset:08x}')
+    return '\n'.join(lines)
+
+class ProgressNone:
+    def start(self, _max=None):
+        pass
+    def next(self):
+        pass
+    def finish(self):
+        pass
+
+meiosis_max_major = 2
+meiosis_min_major = 2
+idVendor = 0x16c0
+idProduct = 0x05dc
+manufacturer = 'russd@asu.edu'
+product = 'vme'
+
+# Commands
+meiosis_buf_write = 1
+meiosis_buf_clear = 0x11
+meiosis_buf_copy = 0x80
+meiosis_stream_data = 0x40
+meiosis_stream_begin = 0x41
+meiosis_page_verify = 0x42
+meiosis_verify_clear = 0x43
+meiosis_page_erase = 3
+meiosis_page_write = 5
+meiosis_dev_read = 10
+meiosis_exit = 128
+meiosis_enter = 0
+
+# Configuration word 0 flags
+meiosis_cfg_setint = (1 << 14)
+meiosis_cfg_info = (1 << 15)
+# Only in the user signature row, the user program calls the bootloader
+# directly and the ABI hash of that bootloader follows the config words
+meiosis_cfg_direct_abi = (1 << 13)
+# Only in the user signature row, the EEPROM writer takes fill records
+meiosis_cfg_eeprom_fill = (1 << 7)
+
+# Info block feature bits
+meiosis_feature_crc = (1 << 0)
+meiosis_feature_long_read = (1 << 1)
+meiosis_feature_page_crc = (1 << 2)
+meiosis_feature_page_copy = (1 << 3)
+meiosis_feature_decompress = (1 << 4)
+meiosis_feature_verify = (1 << 5)
+meiosis_feature_stats = (1 << 6)
+
+feature_names = {
+    meiosis_feature_crc: 'crc',
+    meiosis_feature_long_read: 'long-read',
+    meiosis_feature_page_crc: 'page-crc',
+    meiosis_feature_page_copy: 'page-copy',
+    meiosis_feature_decompress: 'decompress',
+    meiosis_feature_verify: 'verify',
+    meiosis_feature_stats: 'stats',
+}
+
+page_write_retries = 3
+
+# Statistics block kept by the bootloader, see vme_stats in main.c
+stats_magic = 0x5a
+stats_format = '<B9H'
+stats_names = ['resets', 'crc_errors', 'descriptors', 'setups',
+    'fills', 'erases', 'writes', 'other', 'frames']
+
+# Words per page copy command, a copy is only worth it for runs of at least
+# copy_min_words. copy_candidates limits the search for each run.
+copy_max_words = 127
+copy_min_words = 2
+copy_candidates = 64
+
+# Compressed stream tokens, see stream_byte in main.c
+stream_max_literal = 64
+stream_min_match = 2
+stream_max_match = 9
+stream_max_distance = 4096
+stream_pad = 0x40
+
+meiosis_dev_read_flash = (1 << 0)
+# Flash reads past 64KB return at most this many bytes, see vme_elpm_buf
+elpm_buf_len = 8
+meiosis_dev_read_fuse = (1 << 3) | (1 << 0)
+meiosis_dev_read_sig = (1 << 5) | (1 << 0)
+meiosis_dev_read_eeprom = (1 << 6)
+meiosis_dev_read_mem = 0
+
+class find_id:
+    def __init__(self, bus, addr):
+        self.bus = bus
+        self.addr = addr
+
+    def __call__(self, dev):
+        if self.bus is not None and self.bus != dev.bus:
+            return False
+        if self.addr is not None and self.addr != dev.address:
+            return False
+        return True
+
+avrdev_readers = {
+    'flash': (meiosis_dev_read_flash, 0),
+    'eeprom': (meiosis_dev_read_eeprom, 0),
+    'fuse': (meiosis_dev_read_fuse, 0),
+    'lfuse': (meiosis_dev_read_fuse, 0),
+    'hfuse': (meiosis_dev_read_fuse, 3),
+    'efuse': (meiosis_dev_read_fuse, 2),
+    'lock': (meiosis_dev_read_fuse, 1),
+    'lockbits': (meiosis_dev_read_fuse, 1),
+    'signature': (meiosis_dev_read_sig, 0),
+    'sram': (meiosis_dev_read_mem, 0),
+    'io': (meiosis_dev_read_mem, 0),
+}
+
+# Ways of performing each device operation, fastest first. The first one
+# whose required feature bits are all reported by the device is used, so
+# devices without an info block get the paths every bootloader supports.
+# Entries are (name, required features, AVRDev method).
+strategies = {
+    'read': [
+        ('long', meiosis_feature_long_read, 'read_long'),
+        ('packet', 0, 'read_packet'),
+    ],
+    'write_pages': [
+        ('stream', meiosis_feature_decompress, 'write_pages_stream'),
+        ('page', 0, 'write_pages_each'),
+    ],
+    'write_page': [
+        ('page-crc', meiosis_feature_page_crc, 'write_page_crc'),
+        ('word', 0, 'write_page_words'),
+    ],
+}
+
+# Runs of words that are not 0xffff, leading blank words are skipped
+blank_words = re.compile(rb'(?:\xff\xff)*((?:[^\xff].|\xff[^\xff])+)', re.S)
+
+class AVRDev:
+    def __init__(self, usb_dev):
+        self.usb = usb_dev
+        self.dry = False
+        self.features = 0
+        self.verify_writes = False
+        self.expected = {}
+        self.verified = []
+        self.select_strategies()
+
+    def select_strategies(self):
+        self.strategy = {}
+        for op, choices in strategies.items():
+            for name, needs, method in choices:
+                if self.features & needs == needs:
+                    self.strategy[op] = name
+                    setattr(self, op, getattr(self, method))
+                    break
+
+    def feature_names(self):
+        return [name for bit, name in feature_names.items() if self.features & bit]
+
+    def reenumerate(self, request, progress=None):
+        import usb.core
+        port_numbers = self.usb.port_numbers
+        self.cmd(request)
+        self.usb = None
+        slept = 0.0
+        progress.start()
+        while True:
+            time.sleep(0.100)
+            slept += 0.100
+            if slept >= 1.500:
+                self.usb = usb.core.find(port_numbers=port_numbers)
+                if self.usb:
+                    break
+            if slept >= 5.0:
+                raise Exception('Device did not return')
+            progress.next()
+        time.sleep(0.100)
+        progress.finish()
+
+    def cmd(self, request, value=0, index=0):
+        if not self.dry or (request in meiosis_exit, meiosis_enter):
+            #print(f'0x40 {request=:x} {value=:x} {index=:x}')
+            self.usb.ctrl_transfer(0x40, request, value, index, None)
+
+    def read_chunks(self, request, index, _len, chunk):
+        ret = b''
+        #print(f'{request=:x} {value=:x} {index=:x} {_len=:x}')
+        while _len != len(ret):
+            #print(f'{request=:x} {value=:x} {index+len(ret)=:x} {min(_len, chunk)=:x}')
+            addr = index + len(ret)
+            # wValue carries bits 23:16 of the address, reads may not
+            # cross a 64k boundary
+            n = min(_len - len(ret), chunk, 0x10000 - (addr & 0xffff))
+            if request == meiosis_dev_read_flash and addr >= 0x10000:
+                # Past 64KB the bootloader copies flash to vme_elpm_buf
+                n = min(n, elpm_buf_len)
+            rd = self.usb.ctrl_transfer(0xc0, request, addr >> 16, addr & 0xffff, n)
+            if len(rd) != n:
+                raise Exception(f'Short read on {self}')
+            ret += rd
+        #print('done')
+        return ret
+
+    # One packet per transfer
+    def read_packet(self, request, index=0, _len=0):
+        return self.read_chunks(request, index, _len, 8)
+
+    # The bootloader only looks at the low byte of wLength, and a low
+    # byte of 0xff is USB_NO_MSG to V-USB
+    def read_long(self, request, index=0, _len=0):
+        return self.read_chunks(request, index, _len, 254)
+
+    def erase_page(self, addr):
+        #print(f'Erase page {addr:x}')
+        self.cmd(meiosis_page_erase, addr >> 16, addr & 0xffff)
+        time.sleep(self.erase_sleep)
+        if self.verify_writes:
+            wps = self.page_size // self.n_page_erase
+            for wp in range(addr, addr + self.page_size, wps):
+                self.expected[wp] = b'\xff' * wps
+
+    def erase_pages(self, pages, progress=ProgressNone()):
+        progress.start(len(pages))
+        for page in sorted(pages, reverse=True):
+            self.erase_page(page * self.page_size)
+            progress.next()
+        progress.finish()
+
+    def erase_device(self, progress=ProgressNone()):
+        self.erase_pages(range(self.num_user_pages), progress)
+
+    # With verify_writes, the expected contents of every write page erased
+    # so far are kept and each page written is checked by the bootloader
+    # against its CRC. Failures are counted on the device, the status is
+    # read once per write and the first failing page is written again.
+    def page_written(self, page, data):
+        if not self.verify_writes or page not in self.expected:
+            return
+        self.expected[page] = bytes(a & b for a, b in zip(self.expected[page], data))
+        if not self.verified:
+            self.cmd(meiosis_verify_clear)
+        self.cmd(meiosis_page_verify, crc16(self.expected[page]), page)
+        self.verified.append(page)
+
+    def check_written(self):
+        verified, self.verified = self.verified, []
+        if self.dry or not verified:
+            return
+        wps = self.page_size // self.n_page_erase
+        failed = None
+        attempts = 0
+        while True:
+            errors, page = struct.unpack('<BH', self.read(meiosis_dev_read_mem, self.verify_status, 3))
+            if not errors:
+                return
+            attempts = attempts + 1 if page == failed else 1
+            if attempts > page_write_retries:
+                raise Exception(f'Page write at 0x{page:x} failed verify')
+            failed = page
+            # Rewrite the erase page holding it, then check it and every
+            # page after it again
+            erase_page = page - page % self.page_size
+            contents = {wp: self.expected[wp] for wp in range(erase_page, erase_page + self.page_size, wps)}
+            self.erase_page(erase_page)
+            for wp, data in contents.items():
+                spans = [(wp + m.start(1), m.group(1)) for m in blank_words.finditer(data)]
+                if spans:
+                    self.write_page(wp, spans)
+                self.expected[wp] = data
+            self.cmd(meiosis_verify_clear)
+            if page not in verified:
+                raise Exception(f'Unexpected verify failure at 0x{page:x}')
+            for wp in verified[verified.index(page):]:
+                self.cmd(meiosis_page_verify, crc16(self.expected[wp]), wp)
+
+    # Split data into write pages, returns (page, spans) for each page
+    # that has non-blank words, spans being (addr, data) runs of words
+    def plan_flash(self, start, data, finish=False):
+        wps = self.page_size // self.n_page_erase
+        end = start + len(data)
+        if not finish:
+            end = min(end, self.user_size)
+        mv = memoryview(data)
+        blank = b'\xff' * wps
+        plan = []
+        page = start - start % wps
+        while page < end:
+            lo = max(page, start)
+            hi = min(page + wps, end)
+            chunk = mv[lo - start:hi - start]
+            if chunk != blank[:hi - lo]:
+                chunk = bytes(chunk)
+                if len(chunk) & 1:
+                    chunk += b'\xff'
+                spans = [(lo + m.start(1), m.group(1)) for m in blank_words.finditer(chunk)]
+                plan.append((page, spans))
+            page += wps
+        return plan
+
+    # Spans are (addr, data) runs of words or (addr, src, words) copies
+    # from elsewhere in flash
+    def fill_page(self, spans):
+        for span in spans:
+            if len(span) == 3:
+                addr, src, words = span
+                self.cmd(meiosis_buf_copy | words, src, addr)
+                continue
+            addr, data = span
+            for i, (w,) in enumerate(struct.iter_unpack('<H', data)):
+                #print(f'  {addr + i * 2:03x}={w:04x}')
+                self.cmd(meiosis_buf_write, w, (addr + i * 2) & 0xffff)
+
+    def write_page_words(self, page, spans):
+        self.fill_page(spans)
+        #print(f'write {page=:x}')
+        self.cmd(meiosis_page_write, page >> 16, page & 0xffff)
+        time.sleep(self.write_sleep)
+
+    # Write the page buffer. Returns False if the bootloader dropped the
+    # write because the CRC of the filled words did not match.
+    def commit_page(self, page, crc=0):
+        if not self.features & meiosis_feature_page_crc:
+            # wValue carries bits 23:16 of the address instead
+            self.write_page_words(page, [])
+            return True
+        self.cmd(meiosis_page_write, crc, page)
+        time.sleep(self.write_sleep)
+        if self.dry:
+            return True
+        return not self.read(meiosis_dev_read_mem, self.page_status, 1)[0]
+
+    # The page write carries the CRC of the filled words, the bootloader
+    # drops the write on a mismatch and reports it in the status byte
+    def write_page_crc(self, page, spans):
+        crc = spans_crc(spans)
+        for attempt in range(page_write_retries):
+            self.fill_page(spans)
+            if self.commit_page(page, crc):
+                return
+            self.cmd(meiosis_buf_clear)
+        raise Exception(f'Page write at 0x{page:x} failed CRC check')
+
+    # Fill spans for one write page, runs of words already somewhere in
+    # flash become copies if the bootloader supports them
+    def match_page(self, page, want, index):
+        spans = []
+        lit = None
+        i = 0
+        while i < len(want):
+            if want[i:i + 2] == b'\xff\xff':
+                lit = None
+                i += 2
+                continue
+            src, n = None, 0
+            if self.features & meiosis_feature_page_copy:
+                src, n = index.longest(want[i:], copy_max_words * 2)
+            if n >= copy_min_words * 2:
+                spans.append((page + i, src, n // 2))
+                lit = None
+                i += n
+                continue
+            if lit is None:
+                lit = [page + i, b'']
+                spans.append(lit)
+            lit[1] += want[i:i + 2]
+            i += 2
+        return [tuple(span) for span in spans]
+
+    # Update the user area in place rather than erasing it. Only erase pages
+    # that differ from the device are rewritten, top down. The erase page
+    # holding the end of the user area goes first, with user_reset left
+    # blank until the end, so a reset while rewriting stays in the
+    # bootloader through the reset vector. That only fails while page 0 is
+    # erased, a reset then slides over it into page 1. If page 0 changes,
+    # page 1 is first rewritten with jumps to the bootloader and restored
+    # after page 0. Pages are filled before they are erased so that words
+    # can be copied from the page itself.
+    def write_delta(self, data, progress=ProgressNone()):
+        index = FlashIndex(self.read_region('flash', 0, self.bootloader_start))
+        target = bytearray(data)
+        self.end_data[:] = target[self.user_size:]
+        target[self.user_size:] = b'\xff' * len(self.end_data)
+
+        ps = self.page_size
+        pages = [page for page in range(0, self.bootloader_start, ps)
+                    if target[page:page + ps] != index.data[page:page + ps]]
+        if index.data == target[:self.user_size] + self.end_data:
+            # Already up to date
+            pages = []
+        pages.sort(key=lambda page: (page + ps < self.bootloader_start, -page))
+        writes = [(page, target) for page in pages if page > ps]
+        if pages and not pages[-1]:
+            # Two jumps, an sbrs r31, 7 sliding in from page 0 may skip one
+            sled = bytearray(target)
+            sled[ps:2 * ps] = b'\xff' * ps
+            patch_branch(self, sled, self.bootloader_start, ps)
+            patch_branch(self, sled, self.bootloader_start, ps + self.vector_size)
+            writes += [(ps, sled), (0, target), (ps, target)]
+        elif ps in pages:
+            writes.append((ps, target))
+        progress.start(len(writes))
+        for page, contents in writes:
+            self.write_delta_page(page, contents, index)
+            progress.next()
+        progress.finish()
+        self.check_written()
+
+    def write_delta_page(self, page, target, index):
+        ps = self.page_size
+        wps = ps // self.n_page_erase
+        erased = False
+        if self.n_page_erase > 1:
+            self.erase_page(page)
+            index.update(page, b'\xff' * ps)
+            erased = True
+        for wp in range(page, page + ps, wps):
+            want = bytes(target[wp:wp + wps])
+            if want == b'\xff' * wps:
+                continue
+            for attempt in range(page_write_retries):
+                spans = self.match_page(wp, want, index)
+                self.fill_page(spans)
+                if not erased:
+                    self.erase_page(page)
+                    index.update(page, b'\xff' * ps)
+                    erased = True
+                if self.commit_page(wp, spans_crc(spans)):
+                    break
+                self.cmd(meiosis_buf_clear)
+            else:
+                raise Exception(f'Page write at 0x{wp:x} failed CRC check')
+            self.page_written(wp, want)
+            index.update(wp, want)
+        if not erased:
+            self.erase_page(page)
+            index.update(page, b'\xff' * ps)
+
+    # Transfer the data to the microcontroller
+    def write_flash(self, start, data, progress=ProgressNone(), finish=False):
+        if not finish and start + len(data) > self.user_size:
+            end_start = max(0, start - self.user_size)
+            data_start = end_start + self.user_size
+            end_len = start + len(data) - data_start
+            #print(f'{end_start=:x} {end_len=:x} {data_start=:x} {len(data)=:x}')
+            self.end_data[end_start:end_start + end_len] = data[data_start:]
+        plan = self.plan_flash(start, data, finish)
+        progress.start(len(plan))
+        self.write_pages(plan, progress)
+        progress.finish()
+        self.check_written()
+
+    def write_pages_each(self, plan, progress=ProgressNone()):
+        wps = self.page_size // self.n_page_erase
+        for page, spans in plan:
+            self.write_page(page, spans)
+            self.page_written(page, spans_page(page, spans, wps))
+            progress.next()
+
+    # Send runs of consecutive pages through the decompressor, unless
+    # filling the pages word by word takes fewer transfers
+    def write_pages_stream(self, plan, progress=ProgressNone()):
+        wps = self.page_size // self.n_page_erase
+        encoder = StreamEncoder(wps, self.bootloader_start)
+        groups = []
+        for page, spans in plan:
+            data = spans_page(page, spans, wps)
+            if groups and groups[-1][0] + len(groups[-1][1]) == page:
+                groups[-1][1].extend(data)
+            else:
+                groups.append((page, data))
+        streams = [(start, *encoder.encode(start, data)) for start, data in groups]
+
+        words = sum(len(chunk) // 2 for page, spans in plan for addr, chunk in spans)
+        if sum(1 + len(stream) // 4 for start, stream, out in streams) >= words:
+            return self.write_pages_each(plan, progress)
+
+        for (start, stream, out), (_, data) in zip(streams, groups):
+            self.cmd(meiosis_stream_begin, 0, start)
+            pages = 0
+            for i in range(0, len(stream), 4):
+                value, index = struct.unpack_from('<HH', stream, i)
+                self.cmd(meiosis_stream_data, value, index)
+                # The bootloader writes each page as its last word is filled
+                while pages < out[i + 3] * 2 // wps:
+                    time.sleep(self.write_sleep)
+                    self.page_written(start + pages * wps, data[pages * wps:(pages + 1) * wps])
+                    progress.next()
+                    pages += 1
+
+    def write_flash_end(self):
+        #print(f'{self.user_size=:x} {len(self.end_data)=:x}')
+        self.write_flash(self.user_size, self.end_data, finish=True)
+        self.end_data = bytearray(b'\xff' * (self.bootloader_start - self.user_size))
+
+    def read_region(self, region_name, start=0, length=-1, chunk_sz=128, progress=ProgressNone()):
+        reader_request, reader_offset = avrdev_readers[region_name]
+        reader_offset += start
+        region_info = self.part_info['memory'][region_name]
+        if region_name == 'signature':
+            if length == -1:
+                length = 3
+            if reader_offset + length > 3:
+                raise Exception('Read too large')
+            # Always read whole block for simplicity
+            read_sz = 5
+            read_offset = int(region_info.get('offset', 0))
+        else:
+            region_sz = int(region_info.get('size', 0))
+            if length == -1:
+                read_sz = max(region_sz - start, 0)
+                length = read_sz
+            else:
+                read_sz = length
+                if start + read_sz > region_sz:
+                    raise Exception('Read too large')
+            read_offset = reader_offset + int(region_info.get('offset', 0))
+        progress.start((length + chunk_sz - 1) // chunk_sz)
+        data = b''
+        # Read one chunk at a time for a decent progress update rate
+        #print(f'{read_offset=:x} {read_sz=:x}')
+        for i in range(read_offset, read_offset + read_sz, chunk_sz):
+            data += self.read(reader_request, i, min(read_offset + read_sz - i, chunk_sz))
+            progress.next()
+        progress.finish()
+        if region_name == 'signature':
+            data = data[::-2]
+            data = data[start:start + length]
+        return data
+
+    def probe(self, dry_run, db):
+        self.dry = dry_run
+        self.features = 0
+        self.select_strategies()
+        major = self.usb.bcdDevice >> 8
+        if major > meiosis_max_major or major < meiosis_min_major:
+            raise Exception('Unsupported version')
+
+        info = self.read(meiosis_dev_read_sig, 0, 5)
+        self.signature = ''.join([f'{n:02x}' for n in info[::2]])
+        # The low nibble of the second signature byte encodes flash size
+        self.flash_size = 1024 << (info[2] & 0xf)
+
+        info = self.read(meiosis_dev_read_flash, self.flash_size - 4, 4)
+        self.cfg_word_0, self.cfg_word_1 = struct.unpack('<HH', info)
+        self.num_bl_pages = self.cfg_word_0 & 0xff
+        self.cfg_flags = self.cfg_word_0 & (meiosis_cfg_setint | meiosis_cfg_info)
+        self.cfg_word_0 &= ~(0xff | self.cfg_flags)
+        self.vector = (self.cfg_word_0 >> 8) & 0x1f
+        # Parts past 8k have jmp sized interrupt vectors
+        self.vector_size = 4 if self.flash_size > 8192 else 2
+
+        if self.cfg_flags & meiosis_cfg_info:
+            self.probe_info()
+        else:
+            self.probe_db(db)
+        if self.flash_size > 0x10000:
+            # wValue selects the 64k bank, it cannot also carry a CRC or
+            # stream data and the copy and stream paths only use lpm
+            self.features &= ~(meiosis_feature_page_crc |
+                meiosis_feature_page_copy | meiosis_feature_decompress |
+                meiosis_feature_verify)
+        self.select_strategies()
+
+        self.num_pages = self.flash_size // self.page_size
+        self.num_user_pages = self.num_pages - self.num_bl_pages
+        self.bootloader_start = self.num_user_pages * self.page_size
+        end_size = 2 * self.vector_size
+        self.user_size = self.bootloader_start - end_size
+        self.end_data = bytearray(end_size * b'\xff')
+
+    # Read the info block that sits in front of the bootloader vectors
+    def probe_info(self):
+        vectors = self.flash_size - 4 - 6
+        if self.cfg_flags & meiosis_cfg_setint:
+            vectors -= 2
+        version, size = self.read(meiosis_dev_read_flash, vectors - 2, 2)
+        if version < 1 or size < 12:
+            raise Exception(f'Unsupported info block version {version}')
+        info = self.read(meiosis_dev_read_flash, vectors - size, size)
+        (self.features, self.page_size, self.eeprom_size, self.n_page_erase,
+            write_time, erase_time) = struct.unpack_from('<HHHBBB', info)
+        self.page_status = struct.unpack_from('<H', info, 10)[0] if size >= 14 else 0
+        if not self.page_status:
+            self.features &= ~meiosis_feature_page_crc
+        self.verify_status = struct.unpack_from('<H', info, 12)[0] if size >= 16 else 0
+        if not self.verify_status:
+            self.features &= ~meiosis_feature_verify
+        self.stats_addr = struct.unpack_from('<H', info, 14)[0] if size >= 18 else 0
+        if not self.stats_addr:
+            self.features &= ~meiosis_feature_stats
+        self.abi_hash = struct.unpack_from('<H', info, 16)[0] if size >= 20 else 0
+        self.write_sleep = write_time / 10000.0
+        self.erase_sleep = erase_time / 10000.0
+        self.part_info = part_info_from_info(self)
+        self.part_desc = self.part_info['desc']
+
+    def probe_db(self, db):
+        self.part_info = db.lookup(self.signature)
+        if self.part_info is None:
+            raise Exception(f'Unknown part with signature 0x{self.signature}')
+        self.part_desc = self.part_info.get('desc', self.part_info.get('id'))
+        flash_info = self.part_info['memory']['flash']
+        self.n_page_erase = int(self.part_info.get('n_page_erase', '1'))
+        num_pages = int(flash_info['num_pages'], 0)
+        self.page_size = self.n_page_erase * self.flash_size // num_pages
+        self.write_sleep = int(flash_info["max_write_delay"]) / 1000000.0
+        self.erase_sleep = int(self.part_info["chip_erase_delay"]) * self.n_page_erase / 1000000.0
+        self.eeprom_size = int(self.part_info['memory'].get('eeprom', {}).get('size', '0'), 0)
+        self.features = 0
+        self.abi_hash = 0
+
+    # Address of the V-USB interrupt handler, the target of the rjmp in the
+    # bootloader's interrupt vector at the end of flash
+    def isr_entry(self):
+        base = self.flash_size - 10
+        opcode, = struct.unpack('<H', self.read(meiosis_dev_read_flash, base, 2))
+        if (opcode & 0xf000) != 0xc000:
+            raise Exception('Bootloader interrupt vector does not contain an rjmp')
+        offset = opcode & 0xfff
+        if offset & 0x800:
+            offset -= 0x1000
+        addr = (base + 2 + offset * 2) % self.flash_size
+        if addr < self.bootloader_start:
+            raise Exception(f'Bootloader interrupt vector points outside the bootloader (0x{addr:x})')
+        return addr
+
+    # A user program flashed with --direct-irq is bound to the handler
+    # address of that bootloader build. Returns the target of the user USB
+    # vector if it points into the bootloader at anything other than the
+    # bootloader vector or the current handler, None otherwise. The vector
+    # is read from the device unless its contents are given, the handler
+    # address only if the vector points into the bootloader.
+    def stale_direct_irq(self, data=None):
+        if not self.vector:
+            return None
+        addr = self.vector * self.vector_size
+        if data is None:
+            data = self.read(meiosis_dev_read_flash, addr, self.vector_size)
+        vector = SparseImage([(addr, data)])
+        target = branch_to_addr(self, ImageView(vector), addr)
+        if target is None:
+            return None
+        target %= self.flash_size
+        if target < self.bootloader_start or target == self.flash_size - 10:
+            return None
+        if target == self.isr_entry():
+            return None
+        return target
+
+    # Counters kept by the bootloader since power up or since the user
+    # program last ran, None if the bootloader does not keep them
+    def read_stats(self):
+        if not self.features & meiosis_feature_stats:
+            return None
+        data = self.read(meiosis_dev_read_mem, self.stats_addr, struct.calcsize(stats_format))
+        magic, *counters = struct.unpack(stats_format, data)
+        if magic != stats_magic:
+            counters = [0] * len(stats_names)
+        return dict(zip(stats_names, counters))
+
+    def __str__(self):
+        major = self.usb.bcdDevice >> 8
+        minor = self.usb.bcdDevice & 0xff
+        s = f'Bus {self.usb.bus:03d} Device {self.usb.address:03d}: '
+        s += f'ID {self.usb.idVendor:04x}:{self.usb.idProduct:04x} '
+        s += f'{self.usb.manufacturer}/{self.usb.product} v{major}.{minor}'
+        return s
+
+def find_devs(bus=None, address=None, id_vendor=idVendor, id_product=idProduct,
+        manufacturer=manufacturer, product=product):
+    import usb.core
+    devs = []
+    for dev in usb.core.find(find_all=True,
+                idVendor=id_vendor, idProduct=id_product,
+                manufacturer=manufacturer, product=product,
+                custom_match=find_id(bus, address)):
+        devs.append(AVRDev(dev))
+    return devs
+
+# Minimal part description for devices that carry an info block, enough
+# for the memory regions and file formats to work without avrdude.conf.
+def part_info_from_info(dev):
+    memory = {
+        'flash': {'size': str(dev.flash_size)},
+        'signature': {'size': '3'},
+        'lfuse': {'size': '1'},
+        'hfuse': {'size': '1'},
+        'efuse': {'size': '1'},
+        'lock': {'size': '1'},
+    }
+    if dev.eeprom_size:
+        memory['eeprom'] = {'size': str(dev.eeprom_size)}
+    return {
+        'id': None,
+        'desc': f'signature 0x{dev.signature}',
+        'memory': memory,
+    }
+
+class PartDB:
+    '''
+    avrdude.conf part database. Devices with an info block do not need it,
+    so the files are only parsed on the first lookup.
+    '''
+    def __init__(self, config_files=None):
+        self.base_cf = None
+        self.ext_cf = []
+        for cf in config_files or []:
+            if cf[0] == '+':
+                self.ext_cf.append(cf[1:])
+            elif self.base_cf is None:
+                self.base_cf = cf
+            else:
+                raise Exception('More than one config-file specified')
+        self.tree = None
+        self.signatures = None
+
+    def load(self):
+        if self.tree is not None:
+            return
+        base_cf = self.base_cf
+        if base_cf is None:
+            base_cf = '/etc/avrdude.conf'
+        with open(base_cf, 'r') as f:
+            tree = avrdude_conf.parse(f)
+        for cf in self.ext_cf:
+            with open(cf, 'r') as f:
+                avrdude_conf.parse(f, tree)
+        self.signatures = avrdude_conf.signatures(tree)
+        self.tree = tree
+
+    def lookup(self, signature):
+        self.load()
+        name = self.signatures.get(signature, None)
+        return self.tree['part'][name] if name else None
+
+# Part databases, keyed by the list of files
+db_cache = {}
+
+def load_db(config_files=None):
+    key = tuple(config_files or [])
+    if key not in db_cache:
+        db_cache[key] = PartDB(config_files)
+    return db_cache[key]
+
+# Positions of each pair of words in a flash image, used to find runs of
+# words that are already on the device
+class FlashIndex:
+    def __init__(self, data):
+        self.data = bytearray(data)
+        self.pos = {}
+        self.add(0, len(self.data))
+
+    def keys(self, start, end):
+        for addr in range(max(start - 2, 0), min(end, len(self.data) - 2), 2):
+            yield addr, bytes(self.data[addr:addr + 4])
+
+    def add(self, start, end):
+        for addr, key in self.keys(start, end):
+            self.pos.setdefault(key, []).append(addr)
+
+    def remove(self, start, end):
+        for addr, key in self.keys(start, end):
+            self.pos[key].remove(addr)
+
+    def update(self, start, data):
+        self.remove(start, start + len(data))
+        self.data[start:start + len(data)] = data
+        self.add(start, start + len(data))
+
+    # Longest run in flash matching the start of want, (addr, length)
+    def longest(self, want, max_len):
+        max_len = min(max_len, len(want)) & ~1
+        best, best_len = None, 0
+        for addr in self.pos.get(bytes(want[:4]), [])[:copy_candidates]:
+            n = 4
+            while n < max_len and self.data[addr + n:addr + n + 2] == want[n:n + 2]:
+                n += 2
+            if n > best_len:
+                best, best_len = addr, n
+        return best, min(best_len, max_len)
+
+# Encodes pages for the on-device decompressor. Copies refer back to words
+# the stream has already written, and so only to pages that are complete.
+class StreamEncoder:
+    def __init__(self, wps, size):
+        self.wps = wps
+        self.data = bytearray(b'\xff' * size)
+        self.written = set()
+        self.indexed = 0
+        self.pos = {}
+
+    # Index the pairs of words that lie within written pages below limit
+    def index(self, limit):
+        for addr in range(self.indexed, limit - 2, 2):
+            if addr // self.wps in self.written and (addr + 2) // self.wps in self.written:
+                self.pos.setdefault(bytes(self.data[addr:addr + 4]), []).append(addr)
+        self.indexed = max(self.indexed, limit - 2)
+
+    def longest(self, addr, want, limit):
+        max_len = min(stream_max_match * 2, len(want), limit + self.wps - addr)
+        best, best_len = None, 0
+        for n, src in enumerate(reversed(self.pos.get(bytes(want[:4]), []))):
+            if addr - src > stream_max_distance * 2 or n >= copy_candidates:
+                break
+            k = 4
+            while (k < max_len and src + k + 2 <= limit and
+                    (src + k) // self.wps in self.written and
+                    self.data[src + k:src + k + 2] == want[k:k + 2]):
+                k += 2
+            if k > best_len:
+                best, best_len = src, k
+        return best, min(best_len, max_len)
+
+    # Returns the stream and the number of words written after each byte
+    def encode(self, start, data):
+        self.data[start:start + len(data)] = data
+        self.written.update(range(start // self.wps, (start + len(data)) // self.wps))
+        stream = bytearray()
+        out = []
+        words = 0
+        lit = None
+        pos = 0
+        while pos < len(data):
+            addr = start + pos
+            limit = addr - addr % self.wps
+            self.index(limit)
+            src, n = self.longest(addr, data[pos:], limit) if len(data) - pos >= 4 else (None, 0)
+            if n >= stream_min_match * 2:
+                dist = (addr - src) // 2 - 1
+                stream += bytes([0x80 | (n // 2 - stream_min_match) << 4 | dist >> 8, dist & 0xff])
+                words += n // 2
+                out += [words - n // 2, words]
+                lit = None
+                pos += n
+                continue
+            if lit is None or stream[lit] == stream_max_literal - 1:
+                lit = len(stream)
+                stream.append(0)
+                out.append(words)
+            else:
+                stream[lit] += 1
+            stream += data[pos:pos + 2]
+            words += 1
+            out += [words - 1, words]
+            pos += 2
+        while len(stream) % 4:
+            stream.append(stream_pad)
+            out.append(words)
+        return stream, out
+
+# CRC of the words a set of spans fills, copies are not included
+def spans_crc(spans):
+    crc = 0
+    for span in spans:
+        if len(span) == 2:
+            crc = crc16(span[1], crc)
+    return crc
+
+# Contents of a write page after writing spans to it once erased
+def spans_page(page, spans, wps):
+    data = bytearray(b'\xff' * wps)
+    for addr, chunk in spans:
+        data[addr - page:addr - page + len(chunk)] = chunk
+    return data
+
+# CRC16 as kept by the bootloader (reflected 0xa001, initial value 0)
+def crc16(data, crc=0):
+    for b in data:
+        crc ^= b
+        for i in range(8):
+            crc = (crc >> 1) ^ (0xa001 if crc & 1 else 0)
+    return crc
+
+def rjmp_to_addr(data, base):
+    opcode, = struct.unpack('<H', data[base:base + 2])
+
+    if (opcode & 0xf000) != 0xc000:
+        return None
+
+    offset = ((opcode & 0xfff) + 1) * 2
+
+    return (offset + base) & 0x1fff
+
+def jmp_to_addr(data, base):
+    opcode, dest = struct.unpack('<HH', data[base:base + 4])
+
+    if (opcode & 0xfe0e) != 0x940c:
+        return None
+
+    return ((((opcode >> 3) & 0x3e) | (opcode & 1)) << 16 | dest) * 2
+
+# Vectors are rjmp on parts up to 8k and jmp beyond
+def branch_to_addr(dev, data, base):
+    if dev.vector_size == 4:
+        return jmp_to_addr(data, base)
+    return rjmp_to_addr(data, base)
+
+def patch_branch(dev, data, dest, base):
+    if dev.vector_size == 4:
+        patch_jmp(data, dest, base)
+    else:
+        patch_rjmp(data, dest, base)
+
+def patch_rjmp(data, dest, base):
+    rbase = base + 2
+    if dest + 4096 < rbase:
+        dest += 8192
+    if dest - 4094 > rbase:
+        rbase += 8192
+    if dest + 4096 < rbase or dest - 4094 > rbase:
+        raise Exception("rjmp out of range")
+
+    offset = (dest - rbase) // 2
+    data[base:base + 2] = struct.pack('<H', 0xc000 | (offset & 0xfff))
+
+def patch_jmp(data, dest, base):
+    dest //= 2
+    opcode = 0x940c | ((dest >> 16) & 0x3e) << 3 | (dest >> 16) & 1
+    data[base:base + 4] = struct.pack('<HH', opcode, dest & 0xffff)
+
+def patch_reti(data, base):
+    data[base:base + 2] = struct.pack('<H', 0x9518)
+
+# Absolute address slicing of a sparse image for the branch helpers, reads
+# of holes return blank flash and writes overlay the image
+class ImageView:
+    def __init__(self, image):
+        self.image = image
+
+    def __getitem__(self, s):
+        return self.image.get(s.start, s.stop - s.start)
+
+    def __setitem__(self, s, data):
+        self.image.put(s.start, data)
+
+def patch_firmware(dev, image, patch_irq=True, irq_target=None):
+    # Patching only touches a handful of words, the branch helpers read
+    # and write them in place through a view of the copy.
+    flash_start = image.start
+    flash_end = image.end
+    patched = image.copy()
+    data = ImageView(patched)
+    vs = dev.vector_size
+    if image.contains(0, vs):
+        # Find the current user reset vector
+        user_reset = branch_to_addr(dev, data, 0)
+        if user_reset is None:
+            raise Exception('Vector table reset does not contain a jump')
+
+        # Patch in jump to bootloader.
+        patch_branch(dev, data, dev.bootloader_start + 0, 0)
+
+        # Move user reset vector to end of last page. The reset vector
+        # is always the first vector in the tinyvectortable.
+        patch_branch(dev, data, user_reset, dev.bootloader_start - 2 * vs)
+
+    # Check if the user has a handler for the vector v-usb is using
+    vector_addr = dev.vector * vs
+    if patch_irq and dev.vector and image.contains(vector_addr, vector_addr + vs):
+        user_vector = branch_to_addr(dev, data, vector_addr)
+        if user_vector:
+            if flash_start >= user_vector + 2 or flash_end < user_vector:
+                raise Exception('User vector target outside given memory area')
+            next_vector = branch_to_addr(dev, data, user_vector)
+            if next_vector == 0 or next_vector == user_vector:
+                # Jumps to reset vector of self (bad interrupt)
+                user_vector = 0
+        # Patch in jump to chained interrupt handler, through the bootloader
+        # vector unless a direct target is given
+        if irq_target is None:
+            irq_target = dev.flash_size - 10
+        patch_branch(dev, data, irq_target, vector_addr)
+
+        # Allow chaining to a user interrupt handler.
+        if user_vector:
+            patch_branch(dev, data, user_vector, dev.bootloader_start - vs)
+        else:
+            # No handler, just reti
+            patch_reti(data, dev.bootloader_start - vs)
+    else:
+        user_vector = None
+
+    return patched
+
+# Serial number slot reserved with VME_SERIAL_SLOT_LEN in usbdesc.c, a USB
+# string descriptor holding only '0' characters. It is found by its contents,
+# as (address of the characters, length).
+def serial_slots(image):
+    slot = re.compile(rb'(?=([\x04-\xfe])\x03((?:0\x00)+))')
+    found = []
+    for start, data in image:
+        for m in slot.finditer(data):
+            n = m.group(1)[0] - 2
+            if n % 2 == 0 and n <= len(m.group(2)):
+                found.append((start + m.start() + 2, n // 2))
+    return found
+
+# There must be exactly one slot in the image and the serial must fill it
+def patch_serial(image, serial):
+    found = serial_slots(image)
+    if len(found) != 1:
+        raise Exception(f'Expected one serial number slot in the image, found {len(found)}')
+    addr, length = found[0]
+    if len(serial) != length:
+        raise Exception(f'Serial number "{serial}" does not fill the {length} character slot')
+    patched = image.copy()
+    patched.put(addr, serial.encode('utf-16-le'))
+    return patched
+
+meiosis_stage_magic = 0x5356
+
+# Flash layout of a device running a bootloader built with VME_CFG_STAGING,
+# taken from the bootloader image (main.hex, it ends at the end of flash) and
+# the page size. It stands in for a probed AVRDev in patch_firmware() and
+# stage_pages(), the bootloader cannot be probed while the user program runs.
+class StageLayout:
+    def __init__(self, boot, page_size):
+        self.page_size = page_size
+        self.flash_size = boot.end
+        cfg_word_0, = struct.unpack('<H', boot.get(self.flash_size - 4, 2))
+        num_bl_pages = cfg_word_0 & 0xff
+        cfg_word_0 &= ~(0xff | meiosis_cfg_setint | meiosis_cfg_info)
+        self.vector = (cfg_word_0 >> 8) & 0x1f
+        self.vector_size = 4 if self.flash_size > 8192 else 2
+        self.bootloader_start = self.flash_size - num_bl_pages * page_size
+        self.user_size = self.bootloader_start - 2 * self.vector_size
+
+# Pages for a running user program to stage through vmeStageSpm(), as
+# (address, data) in the order they should be written. The sled page goes
+# below the pages to copy, see vme_stage_commit() in stage.c, and the header
+# goes last. The bootloader copies the image into place at the next reset.
+# The running program has to end below the sled page.
+def stage_pages(layout, image):
+    ps = layout.page_size
+    vs = layout.vector_size
+    data = patch_firmware(layout, image).get(0, layout.bootloader_start)
+    last = layout.bootloader_start - ps
+    header = last - ps
+    used = (min(image.end, last) + ps - 1) // ps
+    n = used + 1
+    src = header - n * ps
+    sled = src - ps
+    if sled < used * ps:
+        raise Exception(f'Image too large to stage, {used} pages with {header // ps - used - 2} free')
+    # Two jumps, an sbrs r31, 7 sliding in from erased flash may skip one
+    jumps = bytearray(b'\xff' * (sled + ps))
+    patch_branch(layout, jumps, layout.bootloader_start, sled)
+    patch_branch(layout, jumps, layout.bootloader_start, sled + vs)
+    pages = [(sled, bytes(jumps[sled:]))]
+    pages += [(src + i * ps, data[i * ps:(i + 1) * ps]) for i in range(used)]
+    pages.append((src + used * ps, data[last:last + ps]))
+    pages.append((header, struct.pack('<HB', meiosis_stage_magic, n).ljust(ps, b'\xff')))
+    return pages
+
+def unpatch_firmware(dev, data):
+    # Verify user reset handler
+    data = bytearray(data)
+    if len(data) != dev.bootloader_start:
+        raise Exception
+
+    # Find the current user reset vector
+    vs = dev.vector_size
+    user_reset = branch_to_addr(dev, data, dev.user_size)
+
+    if user_reset is not None:
+        patch_branch(dev, data, user_reset, 0)
+    if dev.vector:
+        user_vector = branch_to_addr(dev, data, dev.user_size + vs)
+        if user_vector is not None:
+            patch_branch(dev, data, user_vector, dev.vector * vs)
+
+    data[dev.user_size:] = 2 * vs * b'\xff'
+    return data
+
+def parse_op(s):
+    if ':' not in s:
+        return ['flash'], 'w', s, 'a'
+    tokens = s.split(':')
+    if len(tokens) < 3:
+        raise Exception('Invalid option format')
+    fmt = tokens.pop() if len(tokens) > 3 and len(tokens[-1]) == 1 else 'a'
+    mem = tokens[0].split(',')
+    op = tokens[1]
+    if op not in 'vrw':
+        raise Exception(f'Unknown operation "{op}"')
+    return mem, op, ':'.join(tokens[2:]), fmt
+
+# Format id to module, modules are only imported once a format is
+# selected or sniffed so missing optional dependencies (eg, elftools)
+# only matter when that format is actually used.
+format_modules = {
+    'e': 'fmt_elf',
+    'i': 'fmt_ihex',
+    'm': 'fmt_imm',
+    'b': 'fmt_imm',
+    'd': 'fmt_imm',
+    'h': 'fmt_imm',
+    'o': 'fmt_imm',
+    'r': 'fmt_rbin',
+    's': 'fmt_srec',
+}
+
+# Format instances, keyed by format id and part
+format_cache = {}
+
+def load_format(fmt_id, part_info):
+    key = (fmt_id, part_info.get('id'))
+    if key not in format_cache:
+        module = importlib.import_module(format_modules[fmt_id])
+        fmt, = [fmt for fmt in module.formats if fmt.id == fmt_id]
+        format_cache[key] = fmt(part_info)
+    return format_cache[key]
+
+def detect_format(fn, part_info):
+    scores = []
+    for fmt_id in format_modules:
+        try:
+            fmt = load_format(fmt_id, part_info)
+        except Exception:
+            continue
+        scores.append((op_detect(fmt, fn), fmt))
+    if not scores:
+        return 0, None
+    return sorted(scores, key=lambda x: x[0])[-1]
+
+avr_region_to_file_region = {
+    'eeprom': ('EEPROM', 0),
+    'flash': ('flash', 0),
+    'fuse': ('fuse', 0),
+    'lfuse': ('fuse', 0),
+    'hfuse': ('fuse', 1),
+    'efuse': ('fuse', 2),
+    'lock': ('lock', 0),
+    'lockbits': ('lock', 0),
+    'signature': ('sigrow', 0),
+    'io': None, # read_mem with given offset
+    'sram': None, # read_mem with given offset
+}
+
+file_regions = [
+    (0x000000, 0x800000, "flash"),
+    (0x800000, 0x010000, "data"),
+    (0x810000, 0x010000, "EEPROM"),
+    (0x820000, 0x010000, "fuse"),
+    (0x830000, 0x010000, "lock"),
+    (0x840000, 0x010000, "sigrow"),
+    (0x850000, 0x010000, "userrow"),
+    (0x860000, 0x010000, "bootrow"),
+]
+
+def file_region_by_addr(addr):
+    for idx, region in enumerate(file_regions):
+        if addr >= region[0] and addr < region[0] + region[1]:
+            return idx
+    return None
+
+def file_region_by_name(name):
+    for idx, region in enumerate(file_regions):
+        if name == region[2]:
+            return idx
+    return None
+
+def op_detect(fmt, fn):
+    try:
+        if hasattr(fmt, 'op_detect_bin'):
+            if fn == '-':
+                return fmt.op_detect_bin(sys.stdin.buffer)
+            else:
+                with open(fn, 'rb') as f:
+                    return fmt.op_detect_bin(f)
+        elif hasattr(fmt, 'op_detect_file'):
+            if fn == '-':
+                return fmt.op_detect_file(sys.stdin)
+            else:
+                with open(fn, 'r') as f:
+                    return fmt.op_detect_file(f)
+        elif hasattr(fmt, 'op_detect_str'):
+            return fmt.op_detect_str(fn)
+        else:
+            raise Exception
+    except:
+        return 0
+
+def op_input(fmt, fn):
+    if hasattr(fmt, 'op_input_bin'):
+        if fn == '-':
+            return fmt.op_input_bin(sys.stdin.buffer)
+        else:
+            with open(fn, 'rb') as f:
+                return fmt.op_input_bin(f)
+    elif hasattr(fmt, 'op_input_file'):
+        if fn == '-':
+            return fmt.op_input_file(sys.stdin)
+        else:
+            with open(fn, 'r') as f:
+                return fmt.op_input_file(f)
+    elif hasattr(fmt, 'op_input_str'):
+        return fmt.op_input_str(fn)
+    else:
+        raise Exception
+
+def op_output(fmt, fn, segments):
+    if hasattr(fmt, 'op_output_bin'):
+        if fn == '-':
+            fmt.op_output_bin(sys.stdout.buffer, segments)
+        else:
+            with open(fn, 'wb') as f:
+                fmt.op_output_bin(f, segments)
+    elif hasattr(fmt, 'op_output_file'):
+        if fn == '-':
+            fmt.op_output_file(sys.stdout, segments)
+        else:
+            with open(fn, 'w') as f:
+                fmt.op_output_file(f, segments)
+    else:
+        raise Exception
+
+# Encode EEPROM contents as the records read by the EEPROM writer in the
+# user signature row, (skip, length, data...), length 0 meaning 256. A
+# skip cannot be larger than 254, longer gaps are bridged by rewriting the
+# current contents of a byte (read returns current EEPROM contents).
+def eeprom_stream(image, read):
+    eeprom_image = b''
+    eeprom_offset = 0
+    for start, data in image:
+        while start - eeprom_offset > 254:
+            eeprom_image += struct.pack('<BB', 254, 1)
+            eeprom_image += read(eeprom_offset + 254, 1)
+            eeprom_offset += 255
+        while len(data):
+            n = min(len(data), 256)
+            eeprom_image += struct.pack('<BB', start - eeprom_offset, n & 0xff)
+            eeprom_image += data[:n]
+            start += n
+            eeprom_offset = start
+            data = data[n:]
+    return eeprom_image
+
+# Records for EEPROM writers that take fill records, (skip, count, ...).
+# Counts below 0x80 carry count + 1 bytes of data, counts from 0x80 up
+# carry one byte filling (count & 0x7f) + 1 bytes. A skip of 0xfe skips
+# 254 bytes on its own. Runs shorter than fill_min stay in data records.
+def eeprom_fill_stream(image, fill_min=4):
+    eeprom_image = b''
+    eeprom_offset = 0
+    def record(start, n, count, payload):
+        nonlocal eeprom_image, eeprom_offset
+        while start - eeprom_offset > 253:
+            eeprom_image += b'\xfe'
+            eeprom_offset += 254
+        eeprom_image += struct.pack('<BB', start - eeprom_offset, count) + payload
+        eeprom_offset = start + n
+    def literal(start, data):
+        for pos in range(0, len(data), 128):
+            chunk = data[pos:pos + 128]
+            record(start + pos, len(chunk), len(chunk) - 1, chunk)
+    for start, data in image:
+        lit = 0
+        i = 0
+        while i < len(data):
+            run = 1
+            while i + run < len(data) and run < 128 and data[i + run] == data[i]:
+                run += 1
+            if run >= fill_min:
+                literal(start + lit, data[lit:i])
+                record(start + i, run, 0x80 | (run - 1), data[i:i + 1])
+                lit = i + run
+            i += run
+        literal(start + lit, data[lit:])
+    return eeprom_image
+
+class Session:
+    '''
+    A programming session on a probed device. Memory operations are read
+    in and checked by add(), nothing is written to the device until run().
+    progress and spinner are factories taking a title.
+    '''
+    def __init__(self, dev, db, dry_run=False, raw=False, erase=False, delta=False,
+            direct_irq=False, serial=None,
+            progress=lambda title: ProgressNone(), spinner=lambda title: ProgressNone()):
+        self.dev = dev
+        self.db = db
+        self.dry_run = dry_run
+        self.raw = raw
+        self.erase = erase
+        self.delta = delta
+        self.direct_irq = direct_irq
+        self.serial = serial
+        self.progress = progress
+        self.spinner = spinner
+
+        self.mem_op = []
+        self.eeprom_writer = None
+        self.eeprom_fill = False
+        # User USB vector as flashed by this session
+        self.user_vector = None
+
+    def enter(self):
+        self.dev.reenumerate(meiosis_enter, self.spinner('  Entering bootloader mode '))
+
+    def probe(self):
+        self.dev.probe(self.dry_run, self.db)
+
+    def format(self, fmt_spec, op, fn):
+        # Check that we support the format requested
+        if fmt_spec in format_modules:
+            return load_format(fmt_spec, self.dev.part_info)
+        elif fmt_spec == 'a' and op in 'wv':
+            score, fmt = detect_format(fn, self.dev.part_info)
+            if not score:
+                raise Exception(f'Could not auto-detect format for {fn}')
+            return fmt
+        else:
+            raise Exception(f'Unknown format for {fn}, "{fmt_spec}"')
+
+    def add(self, avr_mems, op, fn, fmt_spec):
+        fmt = self.format(fmt_spec, op, fn)
+
+        # Figure out the actual list of regions
+        am = []
+        for avr_mem in avr_mems:
+            remove = avr_mem[0] in '\\-'
+            if remove:
+                avr_mem = avr_mem[1:]
+            if avr_mem.lower() == 'all' or avr_mem == 'etc':
+                for name, info in self.dev.part_info['memory'].items():
+                    if name in ('io', 'sram') or name not in avr_region_to_file_region:
+                        continue
+                    if avr_mem == 'ALL' and (name == 'signature' or 'fuse' in name):
+                        continue
+                    if remove:
+                        if name in am:
+                            am.remove(name)
+                    elif name not in am:
+                        am.append(name)
+            elif avr_mem == 'none':
+                pass
+            elif avr_mem not in avr_region_to_file_region:
+                raise Exception(f'Unsupported mem type {avr_mem}')
+            elif remove:
+                if avr_mem in am:
+                    am.remove(avr_mem)
+            elif avr_mem not in am:
+                am.append(avr_mem)
+        avr_mems = am
+
+        # Read in any necessary data from strings/files
+        host_avr_segments = {}
+        if op in 'wv':
+            # Split segments on region boundaries
+            host_file_segments = {}
+            for rname, rstart, image in op_input(fmt, fn).split(file_regions):
+                host_file_segments[rname] = (rstart, image)
+
+            # Check for the EEPROM writer binary and user signature
+            if 'userrow' in host_file_segments:
+                rstart, image = host_file_segments['userrow']
+                for start, data in image:
+                    if start == rstart and len(data) > self.dev.page_size + 4:
+                        cfg_word_0, cfg_word_1 = struct.unpack_from('<HH', data, self.dev.page_size)
+                        direct_abi = cfg_word_0 & meiosis_cfg_direct_abi
+                        self.eeprom_fill = bool(cfg_word_0 & meiosis_cfg_eeprom_fill)
+                        cfg_word_0 &= ~(meiosis_cfg_direct_abi | meiosis_cfg_eeprom_fill)
+                        if cfg_word_0 != self.dev.cfg_word_0 or cfg_word_1 != self.dev.cfg_word_1:
+                            raise Exception(f'User signature in {fn} does not match bootloader')
+                        if direct_abi:
+                            abi_hash, = struct.unpack_from('<H', data, self.dev.page_size + 4)
+                            if abi_hash != self.dev.abi_hash:
+                                raise Exception(f'{fn} is linked against a different bootloader build (ABI 0x{abi_hash:04x}, device 0x{self.dev.abi_hash:04x})')
+                        self.eeprom_writer = data
+
+            # Merge data section onto flash section, data segments are moved
+            # to the end of the flash segments
+            if 'data' in host_file_segments:
+                rstart, image = host_file_segments.pop('data')
+                flash_image = host_file_segments.get('flash', (0, SparseImage()))[1]
+                flash_image.update(image.shift(flash_image.end - rstart))
+                host_file_segments['flash'] = (0, flash_image)
+
+            # Modify the file segments to be avr memory segments
+            if list(host_file_segments) in ([], ['flash']):
+                # No region specific data
+                if len(avr_mems) > 1:
+                    # Multiple regions listed, only accept 1
+                    avr_mems = [n for n in avr_mems if n == 'flash']
+                if len(avr_mems) > 0 and host_file_segments:
+                    host_avr_segments[avr_mems[0]] = host_file_segments['flash'][1]
+            else:
+                # Region specific data, filter by region type
+                for avr_mem in avr_mems:
+                    file_region_name, foffset = avr_region_to_file_region.get(avr_mem, None)
+                    if file_region_name in host_file_segments:
+                        rstart, image = host_file_segments[file_region_name]
+                        host_avr_segments[avr_mem] = image.shift(foffset - rstart)
+
+            for rname, image in host_avr_segments.items():
+                start, data = next(iter(image))
+                if rname == 'signature':
+                    if start == 0 and len(data) >= len(self.dev.signature):
+                        if data[:len(self.dev.signature)] != self.dev.signature:
+                            raise Exception(f'Device signature in {fn} does not match bootloader')
+
+
+        self.mem_op.append((avr_mems, op, fn, fmt, host_avr_segments))
+
+    def plan(self):
+        '''
+        Gather every queued operation into one ordered list of
+        (description, action) steps. Writes to a region are merged, later
+        operations overlaying earlier ones, so the device is erased at most
+        once (plus the EEPROM writer pages), the EEPROM writer is run at
+        most once, verification reads back what was written and the end
+        of the user area is committed once. Verify only regions are
+        checked before anything is erased, reads listed before the first
+        write are done first, all other reads once writing is complete.
+        '''
+        dev = self.dev
+        steps = []
+        def step(desc, fn, *args, **kwargs):
+            steps.append((desc, lambda: fn(*args, **kwargs)))
+
+        pre_reads = []
+        post_reads = []
+        checks = []
+        eeprom = SparseImage()
+        eeprom_verify = False
+        flash = SparseImage()
+        flash_verify = False
+        for avr_mems, op, fn, fmt, host_avr_segments in self.mem_op:
+            if op == 'r':
+                reads = post_reads if eeprom or flash else pre_reads
+                reads.append((avr_mems, fn, fmt))
+                continue
+
+            if 'eeprom' in host_avr_segments:
+                eeprom.update(host_avr_segments['eeprom'])
+                eeprom_verify = eeprom_verify or op == 'v'
+
+            # Trim empty flash
+            flash_image = host_avr_segments.get('flash', SparseImage()).strip(align=2)
+            if flash_image:
+                if flash_image.end > dev.user_size:
+                    raise Exception(f'Image {fn} does not fit within user flash area')
+                flash.update(flash_image)
+                flash_verify = flash_verify or op == 'v'
+
+            # Can "verify" only
+            for avr_mem in [n for n in avr_region_to_file_region.keys() if n not in ('eeprom', 'flash', 'io', 'sram')]:
+                for start, data in host_avr_segments.get(avr_mem, SparseImage()):
+                    checks.append((avr_mem, start, data))
+
+        if flash and flash.start != 0:
+            raise Exception('Vector page of flash *must* be programmed first')
+
+        if eeprom and not flash and not self.erase:
+            raise Exception('Unable to write EEPROM without erasing device')
+
+        if eeprom and not self.eeprom_writer:
+            raise Exception("Unable to write EEPROM without EEPROM writer code")
+
+        for avr_mem, start, data in checks:
+            step(f'check {avr_mem} 0x{start:x}+{len(data)}', self.check_region, avr_mem, start, data)
+
+        for avr_mems, fn, fmt in pre_reads:
+            step(f'read {",".join(avr_mems)} to {fn}', self.read_regions, avr_mems, fn, fmt)
+
+        # Flash can be updated in place unless everything is erased anyway
+        delta = self.delta and flash and not eeprom and not self.erase
+
+        # Let the bootloader check each page as it is written rather than
+        # reading flash back afterwards
+        device_verify = flash_verify and dev.features & meiosis_feature_verify
+        if device_verify:
+            step('verify flash writes on device', self.verify_writes)
+
+        if not delta and (self.erase or eeprom or flash):
+            step(f'erase {dev.num_user_pages} pages', dev.erase_device, self.progress('  Erasing '))
+
+        if eeprom:
+            read = lambda start, length: dev.read_region('eeprom', start, length)
+            if self.eeprom_fill:
+                writer = self.eeprom_writer + eeprom_fill_stream(eeprom)
+            else:
+                writer = self.eeprom_writer + eeprom_stream(eeprom, read)
+            writer = patch_firmware(dev, SparseImage([(0, writer)]))
+            writer = writer.get(0, dev.bootloader_start)
+            step(f'write EEPROM writer, {len(eeprom)} bytes of EEPROM', self.write_eeprom, writer)
+            if eeprom_verify:
+                step(f'verify {len(eeprom)} bytes of EEPROM', self.verify_region, 'eeprom', eeprom, '  Verifying EEPROM ')
+
+            # The rest of flash is still blank from the first erase, only
+            # the EEPROM writer and the end of the user area need erasing.
+            if flash:
+                writer_pages = {page // dev.page_size for page, spans in dev.plan_flash(0, writer, finish=True)}
+                step(f'erase {len(writer_pages)} EEPROM writer pages', dev.erase_pages, writer_pages, self.progress('  Erasing  '))
+
+        if flash and self.serial is not None:
+            flash = patch_serial(flash, self.serial)
+
+        if flash:
+            # Pointing the vector straight at the V-USB handler saves the
+            # hop through the bootloader vector, but ties the user program
+            # to this build of the bootloader
+            irq_target = dev.isr_entry() if self.direct_irq and not self.raw else None
+            patched = patch_firmware(dev, flash, patch_irq=not self.raw, irq_target=irq_target)
+            patched = patched.get(0, dev.bootloader_start)
+            vector_addr = dev.vector * dev.vector_size
+            self.user_vector = patched[vector_addr:vector_addr + dev.vector_size]
+            if delta:
+                step(f'update flash 0x0-0x{flash.end:x} against device', dev.write_delta, patched, self.progress('  Updating '))
+            else:
+                n_pages = len(dev.plan_flash(0, patched))
+                step(f'write flash 0x0-0x{flash.end:x}, {n_pages} pages', dev.write_flash, 0, patched, self.progress('  Flashing '))
+            if flash_verify and not device_verify:
+                image = SparseImage((start, patched[start:start + len(data)]) for start, data in flash)
+                step(f'verify {len(image)} bytes of flash', self.verify_region, 'flash', image, '  Verifying ')
+            step('commit end of user area', self.write_end, flash_verify and not device_verify)
+
+        for avr_mems, fn, fmt in post_reads:
+            step(f'read {",".join(avr_mems)} to {fn}', self.read_regions, avr_mems, fn, fmt)
+
+        return steps
+
+    def execute(self, steps):
+        try:
+            for desc, action in steps:
+                action()
+        finally:
+            # The device may be reused for another session (daemon)
+            self.dev.verify_writes = False
+            self.dev.expected = {}
+
+    def run(self):
+        steps = self.plan()
+        self.execute(steps)
+        return [desc for desc, action in steps]
+
+    def check_region(self, avr_mem, start, data):
+        readback = self.dev.read_region(avr_mem, start, len(data))
+        if data != readback:
+            raise Exception(f'Cannot write to region {avr_mem} and existing data does not match')
+
+    def verify_region(self, avr_mem, image, title):
+        progress = self.progress(title)
+        progress.start(len(image.starts))
+        for start, data in image:
+            readback = self.dev.read_region(avr_mem, start, len(data))
+            if readback != data:
+                raise Exception(f'Readback mismatch when verifying {avr_mem}')
+            progress.next()
+        progress.finish()
+
+    def verify_writes(self):
+        self.dev.verify_writes = True
+        self.dev.expected = {}
+
+    def write_eeprom(self, writer):
+        self.dev.write_flash(0, writer, self.progress('  Flashing EEPROM writer'))
+        self.dev.write_flash_end()
+        self.dev.reenumerate(meiosis_exit, self.spinner('  EEPROM writer running '))
+        self.dev.probe(self.dry_run, self.db)
+
+    def write_end(self, verify):
+        end_data = self.dev.end_data
+        self.dev.write_flash_end()
+        if verify:
+            end = self.dev.read_region('flash', self.dev.user_size, self.dev.bootloader_start - self.dev.user_size)
+            if end != end_data:
+                raise Exception('Verify mismatch when writing end page')
+
+    def read_regions(self, avr_mems, fn, fmt):
+        file_segments = SparseImage()
+        for avr_mem in avr_mems:
+            if avr_mem == 'flash':
+                sz = self.dev.bootloader_start
+            else:
+                sz = -1
+            data = self.dev.read_region(avr_mem, length=sz, progress=self.progress(f'  Reading {avr_mem}'))
+            if avr_mem == 'flash':
+                data = unpatch_firmware(self.dev, data)
+                data = data.rstrip(b'\xff')
+            file_region_name, file_offset = avr_region_to_file_region[avr_mem]
+            idx = file_region_by_name(file_region_name)
+            fstart = file_regions[idx][0]
+            file_segments.put(fstart + file_offset, data)
+
+        op_output(fmt, fn, file_segments)
+
+    def exit(self):
+        stale = None if self.raw else self.dev.stale_direct_irq(self.user_vector)
+        if stale is not None:
+            raise Exception(f'User USB vector jumps to 0x{stale:x}, not the V-USB handler of this bootloader. '
+                'Reflash the user program, with --direct-irq to bind it to this bootloader, or use --raw to run it anyway')
+        self.dev.cmd(meiosis_exit)
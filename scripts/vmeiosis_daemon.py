@@ -0,0 +1,238 @@
+#
+# Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Flashing daemon, accepts jobs as one JSON object per line on a Unix
+# socket and answers with one JSON object per line. Requests:
+#
+#   {"id": 1, "cmd": "list"}
+#   {"id": 2, "cmd": "rescan"}
+#   {"id": 3, "cmd": "job", "bus": 1, "address": 5, "cwd": "/tmp",
+#    "mem_op": ["flash:w:main.hex:i"], "erase": false, "run": false,
+#    "enter": false, "dry_run": false, "raw": false, "delta": false,
+#    "direct_irq": false, "serial": null}
+#
+# A job may select a device by bus/address or by "index" into the list
+# of known devices. While a job runs, progress lines are sent:
+#
+#   {"id": 3, "progress": "Flashing", "value": 10, "max": 37}
+#
+# Every request ends with {"id": ..., "ok": true, "result": ...} or
+# {"id": ..., "ok": false, "error": "..."}.
+
+import json
+import os
+import socketserver
+import threading
+import time
+import vmeiosis
+
+class JsonProgress:
+    def __init__(self, reply, title):
+        self.reply = reply
+        self.title = title.strip()
+        self.value = 0
+        self.max = None
+    def start(self, _max=None):
+        self.max = _max
+        self.value = 0
+        self.send()
+    def next(self):
+        self.value += 1
+        self.send()
+    def finish(self):
+        pass
+    def send(self):
+        self.reply(progress=self.title, value=self.value, max=self.max)
+
+class DevState:
+    def __init__(self, dev):
+        self.dev = dev
+        self.lock = threading.Lock()
+        self.probed = False
+        # Set when a job on the handle failed, the next job rescans
+        self.failed = False
+
+    def key(self):
+        return (self.dev.usb.bus, self.dev.usb.address)
+
+    def info(self):
+        ret = {'bus': self.dev.usb.bus, 'address': self.dev.usb.address, 'desc': str(self.dev)}
+        if self.probed:
+            ret['part'] = self.dev.part_desc
+            ret['signature'] = self.dev.signature
+            ret['user_size'] = self.dev.user_size
+            ret['page_size'] = self.dev.page_size
+            ret['features'] = self.dev.feature_names()
+            ret['strategy'] = self.dev.strategy
+        return ret
+
+class Daemon:
+    def __init__(self, db, find_args, rescan_interval=1.0):
+        self.db = db
+        self.find_args = find_args
+        self.rescan_interval = rescan_interval
+        self.devs = {}
+        self.lock = threading.Lock()
+        self.last_scan = 0.0
+
+    # pyusb has no hotplug notification, devices are picked up and
+    # dropped by rescanning the bus, at most once per interval unless
+    # forced. Devices that are busy with a job are left alone, failed
+    # handles are replaced with fresh ones.
+    def rescan(self, force=False):
+        with self.lock:
+            now = time.monotonic()
+            if not force and now - self.last_scan < self.rescan_interval:
+                return
+            self.last_scan = now
+            found = {}
+            for dev in vmeiosis.find_devs(**self.find_args):
+                found[(dev.usb.bus, dev.usb.address)] = dev
+            for key in list(self.devs):
+                if key not in found and not self.devs[key].lock.locked():
+                    del self.devs[key]
+            for key, dev in found.items():
+                state = self.devs.get(key)
+                if state is None or (state.failed and not state.lock.locked()):
+                    self.devs[key] = DevState(dev)
+
+    def match(self, req):
+        with self.lock:
+            keys = sorted(self.devs)
+            bus = req.get('bus')
+            address = req.get('address')
+            if bus is not None or address is not None:
+                keys = [k for k in keys if (bus is None or k[0] == bus) and
+                                           (address is None or k[1] == address)]
+            else:
+                index = req.get('index', 0)
+                keys = keys[index:index + 1]
+            return self.devs[keys[0]] if keys else None
+
+    # Scanning the bus is slow, only rescan when the requested device is
+    # not known yet or the last job on its handle failed
+    def select(self, req):
+        state = self.match(req)
+        if state is None or state.failed:
+            self.rescan(force=True)
+            state = self.match(req)
+        if state is None:
+            raise Exception('No matching device')
+        return state
+
+    def list(self, req):
+        self.rescan()
+        with self.lock:
+            return [self.devs[key].info() for key in sorted(self.devs)]
+
+    def job(self, req, reply):
+        state = self.select(req)
+        with state.lock:
+            old_key = state.key()
+            try:
+                return self.run_job(state, req, reply)
+            except:
+                # Unknown device state, probe again next time
+                state.probed = False
+                state.failed = True
+                raise
+            finally:
+                with self.lock:
+                    if self.devs.get(old_key) is state:
+                        del self.devs[old_key]
+                    if state.dev.usb is not None:
+                        self.devs[state.key()] = state
+
+    def run_job(self, state, req, reply):
+        dev = state.dev
+        cwd = req.get('cwd', os.getcwd())
+        session = vmeiosis.Session(dev, self.db,
+                    dry_run=req.get('dry_run', False), raw=req.get('raw', False),
+                    erase=req.get('erase', False), delta=req.get('delta', False),
+                    direct_irq=req.get('direct_irq', False),
+                    serial=req.get('serial'),
+                    progress=lambda title: JsonProgress(reply, title),
+                    spinner=lambda title: JsonProgress(reply, title))
+        if req.get('enter', False):
+            session.enter()
+            state.probed = False
+        if state.probed:
+            dev.dry = session.dry_run
+        else:
+            session.probe()
+            state.probed = True
+
+        for s in req.get('mem_op', []):
+            avr_mems, op, fn, fmt_spec = vmeiosis.parse_op(s)
+            if fn == '-':
+                raise Exception('stdin/stdout cannot be used with the daemon')
+            if fmt_spec != 'm':
+                fn = os.path.join(cwd, fn)
+            session.add(avr_mems, op, fn, fmt_spec)
+        plan = session.run()
+        # The EEPROM writer re-enumerates and probes again
+        result = state.info()
+        result['plan'] = plan
+
+        if req.get('run', False):
+            session.exit()
+            dev.usb = None
+        return result
+
+class Handler(socketserver.StreamRequestHandler):
+    def handle(self):
+        daemon = self.server.daemon
+        wlock = threading.Lock()
+        for line in self.rfile:
+            if not line.strip():
+                continue
+            req_id = None
+            def reply(**kwargs):
+                msg = json.dumps({'id': req_id, **kwargs}) + '\n'
+                with wlock:
+                    self.wfile.write(msg.encode())
+                    self.wfile.flush()
+            try:
+                req = json.loads(line)
+                req_id = req.get('id')
+                cmd = req.get('cmd')
+                if cmd == 'list':
+                    result = daemon.list(req)
+                elif cmd == 'rescan':
+                    daemon.rescan(force=True)
+                    result = daemon.list(req)
+                elif cmd == 'job':
+                    result = daemon.job(req, reply)
+                else:
+                    raise Exception(f'Unknown command "{cmd}"')
+            except Exception as e:
+                reply(ok=False, error=str(e))
+            else:
+                reply(ok=True, result=result)
+
+class Server(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    daemon_threads = True
+
+def serve(path, db, find_args, rescan_interval=1.0):
+    if os.path.exists(path):
+        os.unlink(path)
+    with Server(path, Handler) as server:
+        server.daemon = Daemon(db, find_args, rescan_interval)
+        server.daemon.rescan(force=True)
+        try:
+            server.serve_forever()
+        finally:
+            os.unlink(path)
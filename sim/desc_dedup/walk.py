@@ -0,0 +1,155 @@
+#!/usr/bin/python3
+#
+# Copyright (C) 2024 Russ Dill <russ.dill@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Host check of scripts/desc_dedup.py. Descriptor requests are answered by a
+# model of usbCustomDriverDescriptor in main.c, once with the user program's
+# full descriptors and once with the deduplicated ones. Every index the user
+# program served must return the same descriptor. Fixed cases are followed
+# by randomly drawn descriptor sets.
+
+import os
+import random
+import struct
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..', '..', 'scripts'))
+import desc_dedup
+
+USBDESCR_CONFIG = 2
+
+def lookup(user, boot, _type, idx):
+    '''
+    Walk the user blob and then the bootloader blob as the asm does. r20
+    holds the index and is decremented on every entry of the requested type,
+    it is not reloaded before the bootloader blob.
+    '''
+    r20 = idx & 0xff
+    for blob in (user, boot):
+        pos = 0
+        while blob[pos]:
+            n = blob[pos]
+            if blob[pos + 1] == _type:
+                r20 = (r20 - 1) & 0xff
+                if r20 & 0x80:
+                    if _type == USBDESCR_CONFIG:
+                        n = blob[pos + 2]
+                    return bytes(blob[pos:pos + n])
+            pos += n
+    return None
+
+def string(s):
+    data = s.encode('utf-16-le')
+    return bytes([len(data) + 2, 3]) + data
+
+def device(product):
+    return struct.pack('<BBHBBBBHHHBBBB', 18, 1, 0x110, 0, 0, 0, 8,
+            0x16c0, product, 0x100, 1, 2, 0, 1)
+
+def config(value, endpoints):
+    interface = bytes([9, 4, 0, 0, endpoints, 3, 0, 0, 0])
+    hid = bytes([9, 0x21, 0x01, 0x01, 0, 1, 0x22, 22, 0])
+    eps = b''.join(bytes([7, 5, 0x81 + i, 3, 8, 0, 10]) for i in range(endpoints))
+    total = 9 + len(interface) + len(hid) + len(eps)
+    return struct.pack('<BBHBBBBB', 9, 2, total, 1, value, 0, 0x80, 50) + interface + hid + eps
+
+def blob(descs):
+    return b''.join(descs) + b'\0'
+
+def check(name, user_descs, boot_descs, verbose):
+    user = blob(user_descs)
+    boot = blob(boot_descs)
+    keep = desc_dedup.dedup(desc_dedup.entries(user), desc_dedup.entries(boot))
+    dedup = blob(d for t, d in keep)
+    served = {}
+    for _type, data in desc_dedup.entries(user):
+        served[_type] = served.get(_type, 0) + 1
+    failed = 0
+    for _type, n in served.items():
+        for idx in range(n):
+            want = lookup(user, boot, _type, idx)
+            got = lookup(dedup, boot, _type, idx)
+            if want != got:
+                failed += 1
+                if verbose:
+                    print(f'  {name}: type {_type} index {idx} returns {got!r}, expected {want!r}')
+    return failed, len(user) - len(dedup)
+
+lang = bytes([4, 3, 0x09, 0x04])
+
+fixed = [
+    # Changed product string, the serial behind it cannot be dropped
+    ('changed product',
+        [device(0x5dc), config(1, 1), lang, string('vendor'), string('product2'), string('serial')],
+        [device(0x5dc), config(1, 1), lang, string('vendor'), string('product'), string('serial')]),
+    ('identical',
+        [device(0x5dc), config(1, 1), lang, string('vendor'), string('product')],
+        [device(0x5dc), config(1, 1), lang, string('vendor'), string('product')]),
+    # Only the bootloader's first strings can serve the user tail
+    ('shifted strings',
+        [device(0x5dc), config(1, 2), string('a'), string('b'), lang, string('vendor')],
+        [device(0x5dc), config(1, 1), lang, string('vendor'), string('product')]),
+    ('more user strings',
+        [device(0x5df), config(1, 1), lang, string('vendor'), string('product'), string('extra')],
+        [device(0x5dc), config(1, 1), lang, string('vendor'), string('product')]),
+    ('no user strings',
+        [device(0x5df), config(2, 1)],
+        [device(0x5dc), config(1, 1), lang, string('vendor')]),
+]
+
+def random_descs(rng, strings):
+    descs = [device(rng.choice((0x5dc, 0x5df)))]
+    descs += [config(rng.randrange(1, 3), rng.randrange(1, 3)) for i in range(rng.randrange(3))]
+    descs += [rng.choice(strings) for i in range(rng.randrange(6))]
+    rng.shuffle(descs)
+    return descs
+
+def main(argv):
+    runs = 1000
+    seed = 1
+    verbose = False
+    args = iter(argv[1:])
+    for arg in args:
+        if arg == '-n':
+            runs = int(next(args))
+        elif arg == '-s':
+            seed = int(next(args))
+        elif arg == '-v':
+            verbose = True
+        else:
+            print(f'usage: {argv[0]} [-n runs] [-s seed] [-v]', file=sys.stderr)
+            return 2
+
+    total_failed = 0
+    print(f'{"case":<20} {"saved":>6} {"fail":>5}')
+    for name, user, boot in fixed:
+        failed, saved = check(name, user, boot, verbose)
+        print(f'{name:<20} {saved:6d} {failed:5d}')
+        total_failed += failed
+
+    rng = random.Random(seed)
+    strings = [lang] + [string(s) for s in ('vendor', 'product', 'serial', 'x', 'y')]
+    failed = saved = 0
+    for i in range(runs):
+        f, s = check(f'random {i}', random_descs(rng, strings), random_descs(rng, strings), verbose)
+        failed += f
+        saved += s
+    print(f'{f"random x{runs}":<20} {saved / runs:6.1f} {failed:5d}')
+    total_failed += failed
+    return 1 if total_failed else 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
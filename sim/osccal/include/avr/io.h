@@ -0,0 +1,13 @@
+/*
+ * Host stand-in for avr/io.h, just enough for osccal_avr054.c
+ */
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+
+extern unsigned char sim_osccal;
+#define OSCCAL sim_osccal
+
+/* Inline asm in the calibration code has no meaning on the host */
+#define asm(...)
+
+#endif
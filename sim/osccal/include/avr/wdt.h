@@ -0,0 +1 @@
+/* Host stand-in, nothing needed from avr/wdt.h */
@@ -0,0 +1,11 @@
+/*
+ * Host stand-in for util/delay.h. adjust_osccal waits after every OSCCAL
+ * write, which lets the harness count them.
+ */
+#ifndef SIM_UTIL_DELAY_H
+#define SIM_UTIL_DELAY_H
+
+extern void sim_delay_us(double us);
+#define _delay_us(us) sim_delay_us(us)
+
+#endif
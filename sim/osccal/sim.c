@@ -0,0 +1,259 @@
+/*
+ * V-USB Meiosis Bootloader      (c) 2024 Russ Dill <russd@asu.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host harness for the OSCCAL search in osccal_avr054.c. The search is built
+ * unmodified against stand-in AVR headers, osccal_loop() is answered from an
+ * oscillator model and osccal_program() ends the run. Each model is run over
+ * a set of randomly drawn parts and the frames used, OSCCAL writes and final
+ * error are reported. A run fails if it ends up more than one OSCCAL step
+ * worse than the best available value. Runs that measure outside of the
+ * window osccal_loop() can handle (it would never return on hardware) are
+ * counted as hung and also fail, unless -k is given. Their frames and writes
+ * up to that point are included in the averages.
+ */
+
+#include <math.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "osc_ver.h"
+
+/* Same limits and units as osccal_measure_usb.S */
+#define F_CPU_MIN 8000000
+#define F_CPU_MAX 32000000
+#define LOOP_CYCLES 8
+
+extern int osccal_main(void);
+
+unsigned char sim_osccal;
+
+struct part {
+	double f_mid;		/* Frequency at RANGE_MID */
+	double step;		/* Relative change per OSCCAL step */
+	double ripple;		/* Relative size of non-monotonic ripple */
+	double noise;		/* Jitter in loop counts, +/- */
+};
+
+struct model {
+	const char *name;
+	double ripple;		/* In units of step */
+	double noise;
+};
+
+static const struct model models[] = {
+	{ "monotonic", 0, 0 },
+	{ "ripple", 0.6, 0 },
+	{ "noisy", 0, 3 },
+	{ "ripple+noisy", 0.6, 3 },
+};
+
+static double f_cpu = 16500000;
+static const struct part *part;
+static unsigned frames;
+static unsigned writes;
+static int hung;
+static jmp_buf done;
+
+/*
+ * AVR054: monotonic within a range, OSC_VER 5 parts have two overlapping
+ * ranges where 96 in the low range matches 128 in the high range. f_mid is
+ * the frequency in the middle of the range F_CPU is normally found in, the
+ * high range for OSC_VER 5.
+ */
+#if OSC_VER == 3 || OSC_VER == 2 || OSC_VER == 1
+#define RANGE_STEPS 256
+#define RANGE_MID 128
+#elif OSC_VER == 5
+#define RANGE_STEPS 128
+#define RANGE_MID (96 + 64)
+#else
+#define RANGE_STEPS 128
+#define RANGE_MID 64
+#endif
+
+static double freq(unsigned char osccal)
+{
+	double pos = osccal;
+
+#if OSC_VER == 4
+	pos = osccal & 0x7f;
+#elif OSC_VER == 5
+	if (osccal >= 0x80)
+		pos = osccal - 0x80 + 96;
+#endif
+	return part->f_mid * pow(1 + part->step, pos - RANGE_MID) *
+		(1 + part->ripple * sin(osccal * 2.1));
+}
+
+static double noise(void)
+{
+	return part->noise * (2.0 * rand() / RAND_MAX - 1);
+}
+
+short osccal_loop(void)
+{
+	double f = freq(sim_osccal);
+
+	frames++;
+	if (f < F_CPU_MIN || f > F_CPU_MAX) {
+		/* The measurement loop restarts forever */
+		hung = 1;
+		longjmp(done, 1);
+	}
+	/* Positive when running slow, in loop iterations over 1ms */
+	return lround((f_cpu - f) / 1000 / LOOP_CYCLES + noise());
+}
+
+void osccal_program(unsigned char osccal)
+{
+	longjmp(done, 1);
+}
+
+void sim_delay_us(double us)
+{
+	writes++;
+}
+
+static double error(unsigned char osccal)
+{
+	return fabs(freq(osccal) - f_cpu) / f_cpu;
+}
+
+static double best_error(void)
+{
+	double best = INFINITY;
+	unsigned osccal;
+
+	for (osccal = 0; osccal <= (OSC_VER == 4 ? 0x7f : 0xff); osccal++) {
+		double f = freq(osccal);
+		if (f >= F_CPU_MIN && f <= F_CPU_MAX && error(osccal) < best)
+			best = error(osccal);
+	}
+	return best;
+}
+
+static double uniform(double lo, double hi)
+{
+	return lo + (hi - lo) * rand() / RAND_MAX;
+}
+
+static int run_model(const struct model *m, unsigned runs, int verbose, int keep_hung)
+{
+	unsigned i;
+	unsigned max_frames = 0;
+	unsigned long sum_frames = 0;
+	unsigned long sum_writes = 0;
+	double sum_err = 0, max_err = 0, sum_excess = 0;
+	unsigned failed = 0, hangs = 0, counted = 0, finished;
+	struct part p;
+
+	for (i = 0; i < runs; i++) {
+		double err, best;
+
+		/* The middle of the range lands within 30% of nominal and a
+		 * range spans a factor of 2 to 4 */
+		p.f_mid = f_cpu * uniform(0.7, 1.3);
+		p.step = pow(uniform(2, 4), 1.0 / RANGE_STEPS) - 1;
+		p.ripple = m->ripple * p.step;
+		p.noise = m->noise;
+		part = &p;
+		best = best_error();
+		if (best > 0.02)
+			/* Out of reach of this part, not a search problem */
+			continue;
+
+		frames = writes = 0;
+		hung = 0;
+		sim_osccal = 0;
+		if (!setjmp(done))
+			osccal_main();
+		counted++;
+		sum_frames += frames;
+		sum_writes += writes;
+		if (frames > max_frames)
+			max_frames = frames;
+		if (hung) {
+			hangs++;
+			if (verbose)
+				printf("  hung: f_mid %.0f step %.4f osccal %u\n",
+					p.f_mid, p.step, sim_osccal);
+			continue;
+		}
+
+		err = error(sim_osccal);
+		if (err > best + p.step) {
+			failed++;
+			if (verbose)
+				printf("  failed: f_mid %.0f step %.4f osccal %u error %.3f%% best %.3f%%\n",
+					p.f_mid, p.step, sim_osccal, err * 100, best * 100);
+		}
+		sum_err += err;
+		sum_excess += err - best;
+		if (err > max_err)
+			max_err = err;
+	}
+
+	/* Errors are only known for runs that finished */
+	finished = counted - hangs;
+	if (!counted)
+		counted = 1;
+	if (!finished)
+		finished = 1;
+	printf("%-14s %6.2f %5u %7.1f %9.3f%% %8.3f%% %8.3f%% %5u %5u\n", m->name,
+		(double) sum_frames / counted, max_frames,
+		(double) sum_writes / counted, sum_err / finished * 100,
+		max_err * 100, sum_excess / finished * 100, failed, hangs);
+	return failed || (hangs && !keep_hung);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned runs = 1000;
+	unsigned seed = 1;
+	int verbose = 0;
+	int keep_hung = 0;
+	int ret = 0;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-n") && i + 1 < argc)
+			runs = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+			seed = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-f") && i + 1 < argc)
+			f_cpu = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-v"))
+			verbose = 1;
+		else if (!strcmp(argv[i], "-k"))
+			keep_hung = 1;
+		else {
+			fprintf(stderr, "usage: %s [-n runs] [-s seed] [-f f_cpu] [-v] [-k]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	srand(seed);
+	printf("OSC_VER %d, F_CPU %.0f, %u parts per model\n", OSC_VER, f_cpu, runs);
+	printf("%-14s %6s %5s %7s %10s %9s %9s %5s %5s\n", "model", "frames",
+		"max", "writes", "error", "max", "excess", "fail", "hung");
+	for (i = 0; i < sizeof(models) / sizeof(models[0]); i++)
+		ret |= run_model(&models[i], runs, verbose, keep_hung);
+	return ret;
+}
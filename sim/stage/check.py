@@ -0,0 +1,134 @@
+#!/usr/bin/python3
+#
+# Copyright (C) 2024 Russ Dill <russ.dill@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Host check of staging. A running user program is replaced by a new one
+# staged with stage_pages() from scripts/vmeiosis.py, and the commit is run by
+# the stage_sim binaries built from stage.c, with power cut at every page
+# erase and write. The largest and smallest images that fit are followed by
+# randomly sized ones.
+
+import os
+import random
+import subprocess
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..', '..', 'scripts'))
+import vmeiosis
+from sparse_image import SparseImage
+
+# sim, flash size, erase page size, bootloader pages
+parts = [
+    ('stage_sim_64', 8192, 64, 32),
+    ('stage_sim_64x16', 8192, 64, 32),
+    ('stage_sim_128', 16384, 128, 16),
+]
+
+# USB interrupt on vector 1, INT0
+vector = 1
+
+def bootloader(rng, flash_size, page_size, pages):
+    start = flash_size - pages * page_size
+    data = bytearray(rng.randbytes(pages * page_size))
+    data[-4:-2] = (pages | vector << 8).to_bytes(2, 'little')
+    return SparseImage([(start, bytes(data))])
+
+def program(rng, layout, size):
+    vs = layout.vector_size
+    data = bytearray(rng.randbytes(size))
+    for i in range(8):
+        vmeiosis.patch_branch(layout, data, 8 * vs, i * vs)
+    return SparseImage([(0, bytes(data))])
+
+def check(sim, layout, boot, old, new):
+    bs = layout.bootloader_start
+    ps = layout.page_size
+    flash = bytearray(b'\xff' * layout.flash_size)
+    flash[bs:] = boot.get(bs, layout.flash_size - bs)
+    flash[:bs] = vmeiosis.patch_firmware(layout, old).get(0, bs)
+    for addr, data in vmeiosis.stage_pages(layout, new):
+        flash[addr:addr + ps] = data
+    expected = bytearray(flash)
+    expected[:bs] = vmeiosis.patch_firmware(layout, new).get(0, bs)
+    used = (min(new.end, bs - ps) + ps - 1) // ps
+    result = subprocess.run([os.path.join('.', sim), str(layout.flash_size),
+            str(bs - ps), str(used)], input=bytes(flash + expected),
+            capture_output=True, text=False)
+    return result.returncode, result.stdout.decode()
+
+def run(sim, layout, boot, rng, name, new_size, old_size, verbose):
+    rc, out = check(sim, layout, boot, program(rng, layout, old_size),
+            program(rng, layout, new_size))
+    if rc and verbose:
+        print(f'  {sim} {name}: {out.strip()}')
+    return 1 if rc else 0
+
+def main(argv):
+    runs = 20
+    seed = 1
+    verbose = False
+    args = iter(argv[1:])
+    for arg in args:
+        if arg == '-n':
+            runs = int(next(args))
+        elif arg == '-s':
+            seed = int(next(args))
+        elif arg == '-v':
+            verbose = True
+        else:
+            print(f'usage: {argv[0]} [-n runs] [-s seed] [-v]', file=sys.stderr)
+            return 2
+
+    rng = random.Random(seed)
+    total_failed = 0
+    print(f'{"sim":<16} {"case":<12} {"fail":>5}')
+    for sim, flash_size, page_size, pages in parts:
+        boot = bootloader(rng, flash_size, page_size, pages)
+        layout = vmeiosis.StageLayout(boot, page_size)
+        vs = layout.vector_size
+        # Pages below the header, the sled and the last page copy come out
+        # of the same space as the image
+        free = (layout.bootloader_start - 2 * page_size) // page_size
+        most = (free - 2) // 2
+        fixed = [('smallest', 8 * vs + 2, most * page_size),
+                ('largest', most * page_size, (free - most - 2) * page_size)]
+        failed = 0
+        for name, new_size, old_size in fixed:
+            f = run(sim, layout, boot, rng, name, new_size, old_size, verbose)
+            print(f'{sim:<16} {name:<12} {f:5d}')
+            failed += f
+
+        f = 0
+        for i in range(runs):
+            new_size = rng.randrange(8 * vs + 2, most * page_size + 1)
+            used = (new_size + page_size - 1) // page_size
+            old_size = rng.randrange(8 * vs + 2, (free - used - 2) * page_size + 1)
+            f += run(sim, layout, boot, rng, f'random {i}', new_size, old_size, verbose)
+        print(f'{sim:<16} {f"random x{runs}":<12} {f:5d}')
+        failed += f
+
+        # One more page does not fit
+        try:
+            vmeiosis.stage_pages(layout, program(rng, layout, (most + 1) * page_size))
+            print(f'{sim:<16} {"too large":<12} {1:5d}')
+            failed += 1
+        except Exception:
+            print(f'{sim:<16} {"too large":<12} {0:5d}')
+        total_failed += failed
+    return 1 if total_failed else 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,212 @@
+/*
+ * V-USB Meiosis Bootloader      (c) 2024 Russ Dill <russd@asu.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host harness for vme_stage_commit() in stage.c, driven by check.py. Flash
+ * with the image staged by scripts/vmeiosis.py and the expected result are
+ * read from stdin. The commit is run once to count its page erases and
+ * writes, and then again with power cut before each of them. After a cut the
+ * reset is followed from address 0, with either value of r31 bit 7 for the
+ * sbrs that erased flash decodes to. It has to reach the bootloader, which
+ * then runs the commit again. Every run must leave the expected image.
+ */
+
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Same as configuration.h */
+#define VME_STAGE_MAGIC		0x5356
+
+#define FLASH_MAX	0x10000
+
+static uint8_t flash[FLASH_MAX];
+static uint8_t initial[FLASH_MAX];
+static uint8_t expected[FLASH_MAX];
+static uint8_t buffer[SPM_PAGESIZE];
+static unsigned flash_size;
+static uint16_t sim_stage_last;
+static long ops;
+static long cut;
+static jmp_buf power_cut;
+
+static void sim_op(void)
+{
+	if (ops++ == cut)
+		longjmp(power_cut, 1);
+}
+
+static void sim_erase(uint16_t addr)
+{
+	sim_op();
+	memset(flash + (addr & ~(PAGESIZE - 1)), 0xff, PAGESIZE);
+}
+
+static void sim_fill(uint16_t addr, uint16_t data)
+{
+	buffer[addr % SPM_PAGESIZE] = data;
+	buffer[addr % SPM_PAGESIZE + 1] = data >> 8;
+}
+
+/* Programming can only clear bits */
+static void sim_write(uint16_t addr)
+{
+	int i;
+
+	sim_op();
+	addr &= ~(SPM_PAGESIZE - 1);
+	for (i = 0; i < SPM_PAGESIZE; i++)
+		flash[addr + i] &= buffer[i];
+	memset(buffer, 0xff, sizeof(buffer));
+}
+
+static uint16_t sim_word(unsigned addr)
+{
+	return flash[addr] | flash[addr + 1] << 8;
+}
+
+#define boot_page_erase(addr)		sim_erase(addr)
+#define boot_page_fill(addr, data)	sim_fill(addr, data)
+#define boot_page_write(addr)		sim_write(addr)
+#define boot_spm_busy_wait()
+#define wdt_reset()
+#define pgm_read_word(addr)		sim_word(addr)
+#define pgm_read_byte(addr)		flash[addr]
+
+#define VME_STAGE_LAST		sim_stage_last
+#define VME_STAGE_HEADER	(VME_STAGE_LAST - PAGESIZE)
+
+#include "stage.c"
+
+static unsigned insn_words(unsigned addr)
+{
+	uint16_t w = sim_word(addr);
+
+	/* jmp, call, lds and sts */
+	if ((w & 0xfe0c) == 0x940c || (w & 0xfc0f) == 0x9000)
+		return 2;
+	return 1;
+}
+
+/* Follow execution from the reset vector up to the first branch */
+static int reset_reaches_bootloader(int r31_bit7)
+{
+	unsigned bootloader_start = sim_stage_last + PAGESIZE;
+	unsigned pc = 0;
+	unsigned dest;
+	uint16_t w;
+
+	while (pc < bootloader_start) {
+		w = sim_word(pc);
+		if (w == 0xffff) {
+			/* sbrs r31, 7 */
+			pc += 2;
+			if (r31_bit7)
+				pc += insn_words(pc) * 2;
+			continue;
+		}
+		if ((w & 0xf000) == 0xc000) {
+			dest = pc + 2 + ((int16_t) (w << 4) >> 3);
+			dest &= flash_size - 1;
+		} else if ((w & 0xfe0e) == 0x940c) {
+			dest = (((w >> 3) & 0x3e) | (w & 1)) << 16;
+			dest = (dest | sim_word(pc + 2)) * 2;
+		} else
+			return 0;
+		return dest == bootloader_start;
+	}
+	return pc == bootloader_start;
+}
+
+static int check_flash(unsigned used)
+{
+	unsigned header = sim_stage_last - PAGESIZE;
+	unsigned i;
+
+	if (memcmp(flash, expected, used * PAGESIZE))
+		return 0;
+	if (memcmp(flash + sim_stage_last, expected + sim_stage_last,
+						flash_size - sim_stage_last))
+		return 0;
+	for (i = header; i < header + PAGESIZE; i++)
+		if (flash[i] != 0xff)
+			return 0;
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	long total;
+	long c;
+	unsigned used;
+	int failed = 0;
+	int bit7;
+
+	if (argc != 4) {
+		fprintf(stderr, "usage: %s <flash size> <last user page> <pages used>\n", argv[0]);
+		return 2;
+	}
+	flash_size = strtoul(argv[1], NULL, 0);
+	sim_stage_last = strtoul(argv[2], NULL, 0);
+	used = strtoul(argv[3], NULL, 0);
+	if (flash_size > FLASH_MAX ||
+			fread(initial, 1, flash_size, stdin) != flash_size ||
+			fread(expected, 1, flash_size, stdin) != flash_size) {
+		fprintf(stderr, "%s: short input\n", argv[0]);
+		return 2;
+	}
+
+	memcpy(flash, initial, flash_size);
+	memset(buffer, 0xff, sizeof(buffer));
+	cut = -1;
+	ops = 0;
+	vme_stage_commit();
+	total = ops;
+	if (!check_flash(used)) {
+		printf("uninterrupted commit differs\n");
+		return 1;
+	}
+
+	for (c = 0; c < total; c++) {
+		for (bit7 = 0; bit7 < 2; bit7++) {
+			memcpy(flash, initial, flash_size);
+			memset(buffer, 0xff, sizeof(buffer));
+			cut = c;
+			ops = 0;
+			if (!setjmp(power_cut)) {
+				vme_stage_commit();
+				continue;
+			}
+			memset(buffer, 0xff, sizeof(buffer));
+			if (!reset_reaches_bootloader(bit7)) {
+				printf("cut before op %ld, r31 bit 7 %d: reset misses the bootloader\n", c, bit7);
+				failed++;
+				continue;
+			}
+			cut = -1;
+			vme_stage_commit();
+			if (!check_flash(used)) {
+				printf("cut before op %ld, r31 bit 7 %d: restarted commit differs\n", c, bit7);
+				failed++;
+			}
+		}
+	}
+	printf("%ld ops %d failed\n", total, failed);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * V-USB Meiosis Bootloader      (c) 2024 Russ Dill <russd@asu.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Commit of a staged image at reset, included by main.c with VME_CFG_STAGING
+ * and by the host harness in sim/stage. VME_STAGE_LAST, the last user page,
+ * and VME_STAGE_HEADER, the page before it, come from the includer.
+ */
+
+static void stage_spm_wait(void)
+{
+	boot_spm_busy_wait();
+#ifdef RWWSRE
+	boot_rww_enable();
+#endif
+}
+
+static void stage_erase(uint16_t addr)
+{
+	wdt_reset();
+	boot_page_erase(addr);
+	stage_spm_wait();
+}
+
+/*
+ * Called at reset, before the user program can run. The user program
+ * stages n pages directly below the header page, the page before the last
+ * user page, and a sled page below those. It then writes VME_STAGE_MAGIC
+ * and n to the header. The first n - 1 pages go to the start of flash and
+ * the last one replaces the last user page, with user_reset and user_vector.
+ *
+ * Everything from the last user page down is erased first, except for the
+ * staged pages, with page 0 last. Until then the reset vector still jumps
+ * to the bootloader. Once page 0 is erased, a reset slides over erased
+ * flash into the sled page, which starts with two jumps to the bootloader
+ * so either outcome of the sbrs r31, 7 in front of it lands there. Page 0
+ * is written first and the header is erased at the end, a reset before
+ * that starts the commit over.
+ */
+__attribute__((used,noinline)) static void vme_stage_commit(void)
+{
+	uint16_t src;
+	uint16_t dst;
+	uint16_t i;
+	uint8_t n;
+
+	if (pgm_read_word(VME_STAGE_HEADER) != VME_STAGE_MAGIC)
+		return;
+	n = pgm_read_byte(VME_STAGE_HEADER + 2);
+	src = VME_STAGE_HEADER - (uint16_t) n * PAGESIZE;
+
+	stage_erase(VME_STAGE_LAST);
+	/* Skip the sled page below the staged pages */
+	dst = src - PAGESIZE;
+	do {
+		dst -= PAGESIZE;
+		stage_erase(dst);
+	} while (dst);
+
+	while (n--) {
+		if (!n)
+			dst = VME_STAGE_LAST;
+		wdt_reset();
+		for (i = 0; i < PAGESIZE; i += 2) {
+			boot_page_fill(dst + i, pgm_read_word(src + i));
+			if (!((i + 2) % SPM_PAGESIZE)) {
+				boot_page_write(dst + i + 2 - SPM_PAGESIZE);
+				stage_spm_wait();
+			}
+		}
+		src += PAGESIZE;
+		dst += PAGESIZE;
+	}
+	stage_erase(VME_STAGE_HEADER);
+}
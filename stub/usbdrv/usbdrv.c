@@ -20,7 +20,11 @@
 #include <avr/signature.h>
 
 #include <usbdrv.h>
+/* With VME_DESC_DEDUP the descriptors are built separately, see
+ * scripts/desc_dedup.py */
+#if !VME_DESC_DEDUP
 #include <archived/usbdesc.c>
+#endif
 
 #ifdef USB_RESET_HOOK
 static void __usbResetHook(uchar isReset)
@@ -61,6 +61,10 @@ extern usbMsgLen_t usbFunctionSetup(uchar data[8]);
 extern uchar usbFunctionWrite(uchar *data, uchar len);
 extern uchar usbFunctionRead(uchar *data, uchar len);
 extern void usbFunctionWriteOut(uchar *data, uchar len);
+/* Only present if VME_HAVE_vmeOsccalTrack is defined */
+extern schar vmeOsccalTrack(void);
+/* Only present if VME_HAVE_vmeStageSpm is defined, see VME_STAGE_HEADER */
+extern void vmeStageSpm(unsigned addr, unsigned data, uchar cmd);
 
 #include <generated/boot-syms.c>
 
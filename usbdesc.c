@@ -42,6 +42,12 @@
 #define USB_CFG_DESCR_PROPS_HID     9   /* length of HID descriptor in config descriptor below */
 #endif
 
+/* Index of the first serial number character in usbString */
+#define USBDESCR_SERIAL_SLOT ( \
+    (USB_CFG_DESCR_PROPS_STRING_0 == 0) * 2 + \
+    (USB_CFG_DESCR_PROPS_STRING_VENDOR == 0 && USB_CFG_VENDOR_NAME_LEN) * (1 + USB_CFG_VENDOR_NAME_LEN) + \
+    (USB_CFG_DESCR_PROPS_STRING_PRODUCT == 0 && USB_CFG_DEVICE_NAME_LEN) * (1 + USB_CFG_DEVICE_NAME_LEN) + 1)
+
 #define USBDESCR_CONFIG_LEN (18 + 7 * USB_CFG_HAVE_INTRIN_ENDPOINT_DESC + \
                              7 * USB_CFG_HAVE_INTRIN_ENDPOINT3_DESC + \
                              (USB_CFG_DESCR_PROPS_HID & 0xff))
@@ -151,7 +157,11 @@ PROGMEM const struct {
 
 #if USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER == 0 && USB_CFG_SERIAL_NUMBER_LEN
     USB_STRING_DESCRIPTOR_HEADER(USB_CFG_SERIAL_NUMBER_LEN),
+#ifdef USB_CFG_SERIAL_NUMBER
     USB_CFG_SERIAL_NUMBER,
+#else   /* Slot filled in by vmedude.py */
+    [USBDESCR_SERIAL_SLOT ... USBDESCR_SERIAL_SLOT + USB_CFG_SERIAL_NUMBER_LEN - 1] = '0',
+#endif
 #endif
 #endif  /* USB_CFG_DESCR_PROPS_STRINGS == 0 */
     0, /* Final length 0, indicates end */
@@ -63,6 +63,15 @@
 #ifndef USB_CFG_SERIAL_NUMBER_LEN
 #define USB_CFG_SERIAL_NUMBER_LEN 0
 #endif
+/* Reserve a serial number of this many '0' characters to be filled in per
+ * unit when flashing (vmedude.py --serial), instead of USB_CFG_SERIAL_NUMBER */
+#ifndef VME_SERIAL_SLOT_LEN
+#define VME_SERIAL_SLOT_LEN 0
+#endif
+#if VME_SERIAL_SLOT_LEN && !USB_CFG_SERIAL_NUMBER_LEN
+#undef USB_CFG_SERIAL_NUMBER_LEN
+#define USB_CFG_SERIAL_NUMBER_LEN VME_SERIAL_SLOT_LEN
+#endif
 #define HAS_USB_STRING_INDEX_SERIAL_NUMBER (USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER != 0 || USB_CFG_SERIAL_NUMBER_LEN)
 #define USB_STRING_INDEX_SERIAL_NUMBER  USB_STRING_INDEX_2*HAS_USB_STRING_INDEX_SERIAL_NUMBER
 
@@ -22,6 +22,70 @@
 /* Define this to 1 to peform CRC check on flash write/erase commands before
  * executing them. This costs 12 bytes. Not including this risks bricking the
  * device if a CRC error occurs. */
+#define VME_CFG_PAGE_CRC                0
+/* Define this to 1 to have page write commands carry a CRC16 of the words
+ * filled into the page buffer. A page that does not match is not written and
+ * the programming tool retries it, rather than the device re-enumerating as
+ * with VME_CFG_CRC. This only covers the page data, not the commands
+ * themselves. This costs 56 bytes and a byte of RAM. */
+#define VME_CFG_PAGE_COPY               0
+/* Define this to 1 to add a command that fills the page buffer with words
+ * copied from elsewhere in flash. The programming tool uses it with
+ * --delta to send only the parts of an updated image that are not already
+ * on the device. This costs 32 bytes. */
+#define VME_CFG_DECOMPRESS              0
+/* Define this to 1 to accept flash pages as a compressed stream. Runs of
+ * words already written earlier in the stream are sent as short back
+ * references, which roughly halves the transfer time of typical firmware.
+ * Meant for 8kB and larger parts, this costs about 130 bytes. */
+#define VME_CFG_VERIFY                  0
+/* Define this to 1 to add a command that compares the CRC16 of a written
+ * flash page against one sent by the programming tool. Mismatches are
+ * counted in RAM along with the first failing page, so the tool can check a
+ * whole image with one short read instead of reading every page back. This
+ * costs about 90 bytes and 3 bytes of RAM. */
+#define VME_CFG_STATS                   0
+/* Define this to 1 to count setup packets, descriptor requests, CRC
+ * failures, bootloader restarts and flash commands by type, plus frames when
+ * USB_COUNT_SOF is set. vmedude.py --stats prints them, which helps tell
+ * signal problems on the bus from a slow host. This costs about 110 bytes
+ * and 19 bytes of RAM. */
+#define VME_CFG_EXPORTS                 0
+/* Define this to 1 to export the bootloader's usbCrc16 and usbCrc16Append to
+ * the user program through vectors ahead of the info block. A user program
+ * that needs CRC16, for instance to check data with the same polynomial as
+ * USB, then links against the bootloader's copy. This costs 4 bytes. */
+#define VME_CFG_DIRECT_ABI              0
+/* Define this to 1 to let user programs call usbPoll, usbInit and the
+ * interrupt endpoint routines at their real addresses instead of through the
+ * vectors at the end of flash, saving a jump on every call. The user program
+ * is then tied to this exact bootloader build, a hash of the exported layout
+ * is kept in the info block and the programming tool refuses user programs
+ * linked against a different one. This costs no flash. */
+#define VME_CFG_OSCCAL_TRACK            0
+/* Define this to 1 to export vmeOsccalTrack(), which user programs can call
+ * now and then to follow oscillator drift with temperature. It times
+ * VME_OSCCAL_TRACK_FRAMES USB frames against Timer0 and moves OSCCAL by one
+ * step if needed. Requires USB_COUNT_SOF. This costs about 80 bytes. */
+#define VME_OSCCAL_TRACK_FRAMES         16
+#define VME_CFG_STAGING                 0
+/* Define this to 1 to export vmeStageSpm(), which lets a running user program
+ * stage a new image in free flash. The bootloader copies it into place on
+ * the next reset, so the device is only out of service for the copy. This
+ * costs about 150 bytes. */
+#define VME_SERIAL_SLOT_LEN             0
+/* Define this to a length to reserve a serial number string descriptor of
+ * that many '0' characters, filled in per unit when flashing. User programs
+ * can set it in their own usbconfig.h. Ignored if USB_CFG_SERIAL_NUMBER is
+ * defined. */
+#define VME_CFG_INFO                    1
+/* Define this to 1 to include an info block describing the flash layout,
+ * EEPROM size and SPM timings ahead of the bootloader vectors. This costs 20
+ * bytes and allows the programming tool to work without avrdude.conf. */
+#define VME_SPM_WRITE_US                4500
+#define VME_SPM_ERASE_US                4500
+/* Worst case page write and page erase times in microseconds, reported to
+ * the programming tool through the info block. */
 #define VME_MODE_GPIOR_IDX		2
 /* Assign a GPIORn register and bit (in VME_MODE_GPIOR_BIT) to indicate that
  * the system is currently in bootloader mode. This is needed so that the user